@@ -0,0 +1,48 @@
+#ifndef _MESSAGE_BUF_H_
+#define _MESSAGE_BUF_H_
+
+#include "message_queue.h"
+
+/*
+ * Internal interface of attached buffers. Not part of the public API.
+ */
+
+typedef struct _message_sg_entry_t {
+    message_buf_t  *buf;
+    size_t         offset;
+    size_t         length;
+} message_sg_entry_t;
+
+/**
+ * Structure which holds the buffers attached to a message. A message's
+ * pool chunk has a pointer to it after the largest payload. When the
+ * pool is configured with sg_inline entries, the list starts in the
+ * chunk too, right after that pointer; longer lists move to the heap.
+ */
+typedef struct _message_sg_t {
+    uint32_t            count;
+    uint32_t            size;
+    message_sg_entry_t  entry[0];
+} message_sg_t;
+
+#define MSG_SG_SIZE(n) \
+    (sizeof(message_sg_t) + (n) * sizeof(message_sg_entry_t))
+
+/**
+ * Return where the buffer list pointer of a message is kept.
+ */
+message_sg_t **message_sg_slot(message_header_t *);
+
+/**
+ * Return the inline buffer list area of a message, and set the number
+ * of entries it holds. NULL when the pool has no inline entries.
+ */
+message_sg_t *message_sg_inline(message_header_t *, uint32_t *);
+
+/**
+ * Drop the references held by the buffer list of a message and free
+ * the list if it is on the heap.
+ */
+void message_sg_free(message_header_t *);
+
+#endif
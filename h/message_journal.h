@@ -0,0 +1,87 @@
+#ifndef _MESSAGE_JOURNAL_H_
+#define _MESSAGE_JOURNAL_H_
+
+#include "message_queue.h"
+
+/*
+ * Internal interface between message_queue.c and the journal.
+ * Not part of the public API.
+ */
+
+typedef struct _message_journal_t message_journal_t;
+
+/**
+ * Open (or recover) the journal of a queue.
+ * Params
+ *     int : queue id. Used to name the journal files.
+ *     const message_journal_config_t * : journal configuration.
+ * Return
+ *     message_journal_t * : journal handle or NULL on any failure.
+ */
+message_journal_t *
+message_journal_open(int, const message_journal_config_t *);
+
+/**
+ * Flush and close a journal. Files are kept for a later replay.
+ */
+void message_journal_close(message_journal_t *);
+
+/**
+ * Hash a message for message_journal_append. Called by the producer
+ * before it takes the queue write lock.
+ */
+uint64_t message_journal_hash(const message_header_t *);
+
+/**
+ * Write a message into the journal without making it visible.
+ * Must be called with the queue write lock held, and followed by
+ * either message_journal_commit or message_journal_abort.
+ * Params
+ *     message_journal_t * : journal
+ *     message_header_t *  : message
+ *     uint64_t            : hash from message_journal_hash.
+ * Return
+ *     int : 0 for success; -1 for failure
+ */
+int message_journal_append(message_journal_t *, message_header_t *,
+                           uint64_t);
+
+/**
+ * Make the record written by the last append part of the log.
+ */
+void message_journal_commit(message_journal_t *);
+
+/**
+ * Drop the record written by the last append.
+ */
+void message_journal_abort(message_journal_t *);
+
+/**
+ * Acknowledge the oldest delivered messages. Called by the consumer
+ * once messages have been handed to the receive callback, or handled
+ * after message_recv_batch.
+ * Params
+ *     message_journal_t * : journal
+ *     uint32_t            : number of messages
+ */
+void message_journal_ack(message_journal_t *, uint32_t);
+
+/**
+ * Fetch the next un-acknowledged message recovered at open time.
+ * Params
+ *     message_header_t ** : set to a newly allocated message.
+ * Return
+ *     int : 1 when a message is returned; 0 when replay is complete;
+ *          -1 for any failure (e.g. no free message memory).
+ */
+int message_journal_replay_next(message_journal_t *, message_header_t **);
+
+/**
+ * Push all committed records and the acknowledge point to disk, and
+ * remove segments whose messages are all acknowledged.
+ * Return
+ *     int : 0 for success; -1 for failure
+ */
+int message_journal_sync(message_journal_t *);
+
+#endif
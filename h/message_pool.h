@@ -0,0 +1,45 @@
+#ifndef _MESSAGE_POOL_H_
+#define _MESSAGE_POOL_H_
+
+#include "message_queue.h"
+
+/*
+ * Internal fixed-size chunk allocator backing message_new/message_free.
+ * Not part of the public API.
+ */
+
+typedef struct _message_pool_t message_pool_t;
+
+/**
+ * Create a pool.
+ * Params
+ *     uint32_t : chunk size in bytes.
+ *     const message_pool_config_t * : sizing of the pool.
+ * Return
+ *     message_pool_t * : the pool or NULL on any failure.
+ */
+message_pool_t *message_pool_new(uint32_t, const message_pool_config_t *);
+
+/**
+ * Destroy a pool and unmap all of its memory.
+ */
+void message_pool_destroy(message_pool_t *);
+
+/**
+ * Allocate a chunk. The pool grows by one slab when it runs dry.
+ * Return
+ *     void * : the chunk or NULL when the pool is at its maximum.
+ */
+void *message_pool_alloc(message_pool_t *);
+
+/**
+ * Return a chunk to the pool.
+ */
+void message_pool_free(message_pool_t *, void *);
+
+/**
+ * Report pool usage.
+ */
+void message_pool_get_stats(message_pool_t *, message_pool_stats_t *);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef _MESSAGE_PROF_H_
+#define _MESSAGE_PROF_H_
+
+#include "message_queue.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Internal interface between message_queue.c and handler profiling.
+ * Not part of the public API.
+ */
+
+typedef struct _msgq_prof_type_t {
+    uint64_t   calls;
+    uint64_t   samples;
+    uint64_t   total_cycles;
+    uint64_t   max_cycles;
+    uint64_t   hist[MSG_PROF_HIST_BUCKETS];
+} msgq_prof_type_t;
+
+/**
+ * Structure which holds the profile of a queue. Counters are written
+ * by the consumer only, with relaxed atomics so that a snapshot can
+ * be taken from another thread.
+ */
+typedef struct _message_prof_t {
+    message_prof_config_t  cfg;
+    uint32_t               countdown;
+    uint64_t               next_dump_ms;
+    /* Index MSG_PROF_MAX_TYPES holds the other types. */
+    msgq_prof_type_t       types[MSG_PROF_MAX_TYPES + 1];
+    message_prof_entry_t   dump[MSG_PROF_MAX_TYPES + 1];
+} message_prof_t;
+
+/**
+ * Monotonic nanoseconds, for CPUs without a cycle counter read here.
+ */
+uint64_t message_prof_clock(void);
+
+static inline uint64_t
+message_prof_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return message_prof_clock();
+#endif
+}
+
+static inline void
+message_prof_add(uint64_t *counter, uint64_t v)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Sampled part of message_prof_call.
+ */
+void message_prof_sample(msgq_prof_type_t *, uint64_t);
+
+/**
+ * Run a receive handler, counting the call and timing one call out of
+ * sample_rate. The type is read first as the handler may free the
+ * message.
+ */
+static inline void
+message_prof_call(message_prof_t *prof, message_queue_t *que,
+                  msg_handler_cb_func_t rcv_cb, message_header_t *m,
+                  void *arg)
+{
+    uint32_t type = (uint32_t)MSG_TYPE(m);
+    msgq_prof_type_t *t;
+    uint64_t start;
+
+    t = &prof->types[type < MSG_PROF_MAX_TYPES ? type : MSG_PROF_MAX_TYPES];
+    message_prof_add(&t->calls, 1);
+    if (--prof->countdown) {
+        rcv_cb(que, m, arg);
+        return;
+    }
+    prof->countdown = prof->cfg.sample_rate;
+    start = message_prof_cycles();
+    rcv_cb(que, m, arg);
+    message_prof_sample(t, message_prof_cycles() - start);
+}
+
+/**
+ * Run the dump callback if its interval has passed. Called by the
+ * consumer at the end of each message_recv.
+ */
+void message_prof_tick(message_prof_t *, message_queue_t *);
+
+/**
+ * Create a profile.
+ * Return
+ *     message_prof_t * : the profile or NULL on failure.
+ */
+message_prof_t *message_prof_new(const message_prof_config_t *);
+
+/**
+ * Free a profile.
+ */
+void message_prof_free(message_prof_t *);
+
+/**
+ * Fill entries with the types seen so far.
+ * Return
+ *     int : Number of the entries filled.
+ */
+int message_prof_snapshot(message_prof_t *, message_prof_entry_t *, int);
+
+#endif
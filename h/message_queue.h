@@ -5,6 +5,10 @@
 #include <assert.h>
 #include "ring_buffer.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifndef UNUSED
 #define UNUSED(x) (void)(x)
 #endif
@@ -22,6 +26,7 @@ typedef struct _message_header_t {
 #define MSG_TYPE(m)  ((m)->message_type)
 #define MSG_SIZE(m)  ((m)->message_length)
 #define MSG_SRC(m)   ((m)->src_id)
+#define MSG_HAS_BUFS(m) (message_buf_count(m) != 0)
 
 #define MSG_MAGIC   0xDEADBEEF
 
@@ -40,17 +45,92 @@ typedef struct _message_queue_t message_queue_t;
  */
 int message_queue_init (int, int);
 
+/**
+ * Structure which configures the message pool.
+ */
+typedef struct _message_pool_config_t {
+    /*
+     * Messages allocated at initialization. Exact; room left in the
+     * last hugepage is not used.
+     */
+    uint32_t   initial_count;
+    /*
+     * Messages added each time the pool runs dry. Growth maps one
+     * hugepage-backed slab, rounded up to whole hugepages.
+     * 0 disables growth.
+     */
+    uint32_t   grow_count;
+    /* Upper bound of messages in the pool. 0 for no limit. */
+    uint32_t   max_count;
+    /*
+     * Attached buffer ranges kept in each message's pool memory, so
+     * that attaching them needs no heap allocation. Each one adds 24
+     * bytes to every message. 0 keeps buffer lists on the heap.
+     */
+    uint32_t   sg_inline;
+} message_pool_config_t;
+
+/**
+ * Subsys Initialization with an explicit message pool configuration.
+ * message_queue_init uses an initial pool of 256 messages which grows
+ * by 4096 messages at a time, up to 1M messages.
+ * Params
+ *     int :  Max queue number.
+ *     int :  Max message size
+ *     const message_pool_config_t * : message pool configuration.
+ * Return
+ *     int :  0 for success; -1 for failure
+ */
+int message_queue_init_ex (int, int, const message_pool_config_t *);
+
+/**
+ * Structure which reports message pool usage.
+ */
+typedef struct _message_pool_stats_t {
+    uint64_t   total;        /* messages the pool can hold now */
+    uint64_t   in_use;       /* messages allocated */
+    uint64_t   free;         /* messages available without growth */
+    uint64_t   high_water;   /* highest in_use seen */
+    uint64_t   slabs;        /* slabs mapped */
+} message_pool_stats_t;
+
+/**
+ * Report message pool usage.
+ * Params
+ *     message_pool_stats_t * : filled with the current usage.
+ * Return
+ *     int :  0 for success; -1 if the subsys is not initialized.
+ */
+int message_queue_pool_stats (message_pool_stats_t *);
+
 /**
  * Return the associcated eventfd of a message queue
  * Params
  *     message_queue_t * :  pointer to a message queue
  * Return:
- *     int               :  eventfd handle.
+ *     int               :  eventfd handle, or -1 if the queue has
+ *                          no eventfd.
  */
 int message_queue_get_fd(message_queue_t *);
 
+/**
+ * Return whether a message queue uses the futex backend.
+ * Params
+ *     message_queue_t * :  pointer to a message queue
+ * Return:
+ *     int               :  1 for a futex queue; 0 otherwise.
+ */
+int message_queue_is_futex(message_queue_t *);
+
 
 typedef void (*msg_notif_cb_func_t)(message_queue_t *, void *arg);
+
+/*
+ * Notification callback value which selects the futex backend: no
+ * file descriptor, and no syscall on send unless the consumer sleeps
+ * in message_recv_wait. The queue cannot be watched through epoll.
+ */
+#define MSG_NOTIF_FUTEX  ((msg_notif_cb_func_t)1)
 /**
  * Create a new message queue
  * Params
@@ -60,6 +140,8 @@ typedef void (*msg_notif_cb_func_t)(message_queue_t *, void *arg);
  *                 An external notification callback provided by caller.
  *                 If this parameter is set to NULL, message_queue_new
  *                 allocates a new eventfd for message notification.
+ *                 If set to MSG_NOTIF_FUTEX, the consumer waits
+ *                 with message_recv_wait on a futex in the queue.
  *                 Otherwise, the callback provided by caller
  *                 is responsible for the entire notification.
  *     void *      argument to be passed to external callback.
@@ -70,6 +152,39 @@ typedef void (*msg_notif_cb_func_t)(message_queue_t *, void *arg);
 message_queue_t *
 message_queue_new (int, uint32_t, msg_notif_cb_func_t, void *);
 
+/**
+ * Create a new fan-in message queue. Every producer thread sending to
+ * this queue gets a private single-producer ring, so producers do not
+ * contend with each other on the send path. A thread is registered on
+ * its first message_send, or explicitly with
+ * message_queue_register_producer. Its ring is released for reuse when
+ * the thread exits. Ordering is kept per producer only.
+ * Params
+ *     int      :  id to identify this queue.
+ *     uint32_t :  depth of each producer ring. Must be power of 2.
+ *     uint32_t :  max number of producer threads at a time.
+ *     msg_notif_cb_func_t :
+ *                 Same as message_queue_new. Notification happens
+ *                 only when a producer ring turns non-empty.
+ *     void *      argument to be passed to external callback.
+ * Return
+ *     message_queue_t *
+ *              :  Pointer to the new queue or NULL on any failure.
+ */
+message_queue_t *
+message_queue_new_fanin (int, uint32_t, uint32_t,
+                         msg_notif_cb_func_t, void *);
+
+/**
+ * Register the calling thread as a producer of a fan-in queue.
+ * Params
+ *     int      :  fan-in queue id.
+ * Return
+ *     int      :  0 for success; -1 if no producer ring is left
+ *                 or the queue is not a fan-in queue.
+ */
+int message_queue_register_producer (int);
+
 /**
  * Destroy a message queue
  * Params
@@ -101,14 +216,117 @@ message_header_t *message_new (int, int, int);
  */
 void message_free (message_header_t *);
 
+typedef struct _message_buf_t message_buf_t;
+
+typedef void (*msg_buf_release_func_t)(void *base, size_t len, void *arg);
+
+/**
+ * Allocate a reference-counted external buffer, for payloads larger
+ * than a message. The memory is mapped directly and advised for
+ * transparent hugepages.
+ * Params
+ *     size_t   :  buffer length.
+ * Return
+ *     message_buf_t * :
+ *              the buffer holding one reference, or NULL on failure.
+ */
+message_buf_t *message_buf_new (size_t);
+
+/**
+ * Wrap caller-owned memory, e.g. an mmap'd file region or a buffer
+ * taken from an application pool, into a reference-counted buffer.
+ * Params
+ *     void *   :  start of the memory.
+ *     size_t   :  length of the memory.
+ *     msg_buf_release_func_t :
+ *                 called with the memory once the last reference is
+ *                 dropped, e.g. to munmap it or to return it to its
+ *                 pool. May be NULL.
+ *     void *   :  argument to be passed to the callback.
+ * Return
+ *     message_buf_t * :
+ *              the buffer holding one reference, or NULL on failure.
+ */
+message_buf_t *message_buf_wrap (void *, size_t,
+                                 msg_buf_release_func_t, void *);
+
+/**
+ * Take an extra reference to a buffer.
+ */
+void message_buf_get (message_buf_t *);
+
+/**
+ * Drop a reference to a buffer. The buffer is released with the
+ * last reference.
+ */
+void message_buf_put (message_buf_t *);
+
+/**
+ * Return the memory of a buffer.
+ * Params
+ *     message_buf_t * : buffer
+ *     size_t *        : set to the buffer length if not NULL.
+ * Return
+ *     void *          : start of the buffer memory.
+ */
+void *message_buf_data (message_buf_t *, size_t *);
+
+/**
+ * Attach a range of a buffer to a message. The caller's reference
+ * moves to the message; call message_buf_get first to keep one.
+ * Attached buffers travel with the message without being copied, and
+ * are released by message_free.
+ * Params
+ *     message_header_t * : message
+ *     message_buf_t *    : buffer
+ *     size_t             : offset of the range in the buffer.
+ *     size_t             : length of the range.
+ * Return
+ *     int      : 0 for success; -1 for failure, in which case the
+ *                reference stays with the caller.
+ */
+int message_attach (message_header_t *, message_buf_t *, size_t, size_t);
+
+/**
+ * Number of buffer ranges attached to a message.
+ */
+int message_buf_count (message_header_t *);
+
+/**
+ * Return one attached range.
+ * Params
+ *     message_header_t * : message
+ *     int                : index, below message_buf_count.
+ *     struct iovec *     : set to the range if not NULL.
+ * Return
+ *     message_buf_t *    : the buffer, still owned by the message;
+ *                          NULL if the index is out of range.
+ */
+struct iovec;
+message_buf_t *message_buf_at (message_header_t *, int, struct iovec *);
+
+/**
+ * Fill an iovec array with the attached ranges of a message.
+ * Params
+ *     message_header_t * : message
+ *     struct iovec *     : array to be filled.
+ *     int                : size of the array.
+ * Return
+ *     int                : Number of the entries filled.
+ */
+int message_get_iov (message_header_t *, struct iovec *, int);
+
 /**
  * Send a message to destiantion queue.
+ * Messages with attached buffers are refused by journaled queues.
  * Params
  *     message_header_t *   : Message to be sent
  *     int                  : Destination queue(module) ID
  * Return
  *     int                  :  0 for success;
- *                            -1 for any failure
+ *                            -1 for any failure. errno is EAGAIN
+ *                            when the queue is full, and the send
+ *                            may be retried.
  */
 int message_send (message_header_t *, int);
 
@@ -126,4 +344,256 @@ typedef void (*msg_handler_cb_func_t)(message_queue_t *, \
  */
 int message_recv (message_queue_t *, msg_handler_cb_func_t, void *);
 
+/**
+ * Retrieve up to a given number of messages without a callback, so
+ * that the caller can handle them in its own loop. The caller owns
+ * the returned messages. An eventfd stays readable while messages
+ * are left in the queue. On a journaled queue the messages are not
+ * acknowledged; call message_recv_ack once they are handled.
+ * Params
+ *     message_queue_t *     : message queue
+ *     message_header_t **   : array to be filled with messages.
+ *     int                   : size of the array.
+ * Return
+ *     int                   : Number of the messages retrieved.
+ */
+int message_recv_batch (message_queue_t *, message_header_t **, int);
+
+/**
+ * Acknowledge messages retrieved through message_recv_batch, oldest
+ * first, once the caller has handled them. Does nothing on a queue
+ * without a journal.
+ * Params
+ *     message_queue_t *     : message queue
+ *     int                   : number of the messages handled.
+ */
+void message_recv_ack (message_queue_t *, int);
+
+/**
+ * Wait for messages and retrieve them as message_recv does. Queues
+ * on the futex backend sleep on the futex; eventfd queues poll their
+ * eventfd. Not available for queues in callback mode.
+ * Params
+ *     message_queue_t *     : message queue
+ *     msg_handler_cb_func_t : callback to handle each message.
+ *     void *                : param to be passed to callback above.
+ *     int                   : timeout in milliseconds; -1 waits
+ *                             forever, 0 does not wait.
+ * Return
+ *     int                   : Number of the messages processed; 0 on
+ *                             timeout; -1 for any failure.
+ */
+int message_recv_wait (message_queue_t *, msg_handler_cb_func_t, void *,
+                       int);
+
+typedef void (*msg_wm_cb_func_t)(message_queue_t *, int throttled,
+                                 void *arg);
+/**
+ * Enable flow control of a queue. When a send brings the queue depth
+ * to the high watermark, the queue is marked throttled and producers
+ * are notified once. When message_recv (or message_recv_batch) brings
+ * the depth below the low watermark, the mark is cleared and producers
+ * are notified once again.
+ * Not available on fan-in queues.
+ * Params
+ *     message_queue_t * : message queue
+ *     uint32_t          : high watermark, not above the queue depth.
+ *     uint32_t          : low watermark, below the high watermark.
+ *     msg_wm_cb_func_t  :
+ *                 Callback with the new state, 1 for throttled and 0
+ *                 for resumed. It runs on the producer thread that
+ *                 crossed the high mark, or on the consumer thread.
+ *                 Calls are serialized and alternate between the two
+ *                 states, the last one being the current state.
+ *                 If this parameter is set to NULL, an eventfd is
+ *                 allocated instead. It becomes readable on each
+ *                 transition; see message_queue_get_wm_fd and
+ *                 message_queue_is_throttled.
+ *     void *            : argument to be passed to the callback.
+ * Return
+ *     int      : 0 for success; -1 for failure
+ */
+int message_queue_set_watermarks (message_queue_t *, uint32_t, uint32_t,
+                                  msg_wm_cb_func_t, void *);
+
+/**
+ * Return the flow control eventfd of a queue.
+ * Params
+ *     message_queue_t * : message queue
+ * Return
+ *     int               : eventfd handle, or -1 if flow control is
+ *                         off or uses a callback.
+ */
+int message_queue_get_wm_fd (message_queue_t *);
+
+/**
+ * Tell whether producers should hold off sending to a queue.
+ * Params
+ *     int               : Destination queue(module) ID
+ * Return
+ *     int               : 1 if throttled; 0 otherwise.
+ */
+int message_queue_is_throttled (int);
+
+/**
+ * Journal flush methods.
+ */
+enum {
+    MSG_JOURNAL_MSYNC = 0,
+    MSG_JOURNAL_FDATASYNC
+};
+
+/**
+ * Structure which configures a queue journal.
+ */
+typedef struct _message_journal_config_t {
+    /* Directory holding the journal files. Created if missing. */
+    const char *dir;
+    /* Size of one log segment in bytes. 0 selects 16MB. */
+    uint32_t   segment_size;
+    /*
+     * Group commit interval in milliseconds. A background thread
+     * flushes all records written within the interval at once, and
+     * creates the next segment ahead of time.
+     * 0 disables the thread; message_queue_journal_sync has to be
+     * called instead, and a send filling a segment may create the
+     * next one itself.
+     */
+    uint32_t   flush_interval_ms;
+    /* MSG_JOURNAL_MSYNC or MSG_JOURNAL_FDATASYNC. */
+    int32_t    sync_mode;
+} message_journal_config_t;
+
+/**
+ * Enable the persistent journal of a queue. Every message sent to the
+ * queue afterwards is appended to a memory-mapped log, and is
+ * acknowledged once message_recv has handed it to the callback, or
+ * when message_recv_ack is called for it after message_recv_batch.
+ * Un-acknowledged messages found in an existing journal are kept for
+ * message_queue_journal_replay. Attached buffers cannot be journaled;
+ * message_send refuses messages carrying them.
+ * Must be called before any message is sent to the queue.
+ * Params
+ *     message_queue_t *                : message queue
+ *     const message_journal_config_t * : journal configuration
+ * Return
+ *     int      : 0 for success; -1 for failure
+ */
+int message_queue_journal_enable (message_queue_t *,
+                                  const message_journal_config_t *);
+
+/**
+ * Re-deliver messages which were not acknowledged before the last
+ * shutdown or crash. Recovered messages are put into the queue and
+ * retrieved through message_recv as usual. At most a queue-full of
+ * messages is put each time; call it again after message_recv until
+ * it returns 0. Should be completed before producers start.
+ * Params
+ *     message_queue_t * : message queue
+ * Return
+ *     int               : Number of the messages re-queued;
+ *                         -1 for any failure
+ */
+int message_queue_journal_replay (message_queue_t *);
+
+/**
+ * Flush the journal of a queue to disk.
+ * Params
+ *     message_queue_t * : message queue
+ * Return
+ *     int               : 0 for success; -1 for failure
+ */
+int message_queue_journal_sync (message_queue_t *);
+
+/*
+ * Handler profiling.
+ */
+
+/* Message types tracked one by one; others share one bucket. */
+#define MSG_PROF_MAX_TYPES     256
+#define MSG_PROF_TYPE_OTHER    (-1)
+/* Histogram bucket n counts samples of [2^(n-1), 2^n) cycles. */
+#define MSG_PROF_HIST_BUCKETS  32
+
+/**
+ * Structure which holds the profile of one message type.
+ */
+typedef struct _message_prof_entry_t {
+    /* Message type, or MSG_PROF_TYPE_OTHER. */
+    int32_t    message_type;
+    /* Handler calls, sampled or not. */
+    uint64_t   calls;
+    /* Sampled calls, and their cycles. */
+    uint64_t   samples;
+    uint64_t   total_cycles;
+    uint64_t   max_cycles;
+    uint64_t   hist[MSG_PROF_HIST_BUCKETS];
+} message_prof_entry_t;
+
+typedef void (*msg_prof_dump_func_t)(message_queue_t *que,
+                                     const message_prof_entry_t *entries,
+                                     int num, void *arg);
+
+/**
+ * Structure which configures handler profiling.
+ */
+typedef struct _message_prof_config_t {
+    /*
+     * Time one handler call out of sample_rate. 0 or 1 times every
+     * call. A rate of 64 or more keeps the cost well below 1% for
+     * handlers of a few hundred cycles.
+     */
+    uint32_t              sample_rate;
+    /*
+     * Optional. dump_cb is called by the consumer with the profile of
+     * the types seen so far, at the end of the first message_recv
+     * call after each dump_interval_ms. A queue nobody calls
+     * message_recv on does not dump; use message_queue_prof_snapshot
+     * from another thread instead. 0 disables the dump.
+     */
+    uint32_t              dump_interval_ms;
+    msg_prof_dump_func_t  dump_cb;
+    void                  *dump_arg;
+} message_prof_config_t;
+
+/**
+ * Enable handler profiling on a queue. message_recv then counts the
+ * handler calls of each message type and samples their cost in CPU
+ * cycles. Handlers run through message_recv_batch are not profiled.
+ * Must not be called while message_recv runs on the queue. Enabling
+ * again resets the profile.
+ * Params
+ *     message_queue_t *             : message queue
+ *     const message_prof_config_t * : profiling configuration
+ * Return
+ *     int      : 0 for success; -1 for failure
+ */
+int message_queue_prof_enable (message_queue_t *,
+                               const message_prof_config_t *);
+
+/**
+ * Disable handler profiling on a queue and drop the profile.
+ * Must not be called while message_recv runs on the queue.
+ */
+void message_queue_prof_disable (message_queue_t *);
+
+/**
+ * Take a snapshot of the profile of a queue. May be called from any
+ * thread; the counters of one entry may be a few calls apart.
+ * Params
+ *     message_queue_t *      : message queue
+ *     message_prof_entry_t * : array to be filled with the types seen,
+ *                              in ascending order, other types last.
+ *     int                    : size of the array.
+ * Return
+ *     int      : Number of the entries filled; -1 if profiling is not
+ *                enabled.
+ */
+int message_queue_prof_snapshot (message_queue_t *,
+                                 message_prof_entry_t *, int);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,350 @@
+/*
+ * Header-only C++17 layer over message_queue.h.
+ *
+ * A message type is any class with a compile-time id:
+ *
+ *     struct ping { static constexpr int message_id = 1; uint32_t ttl; };
+ *
+ * It is constructed in place in pool memory behind a message_header_t,
+ * and received as a move-only mq::MsgPtr<T> which destroys and frees
+ * the message unless it is sent on.
+ *
+ *     mq::Queue<ping, pong> q(mod_0, 512);
+ *     mq::send<ping>(mod_0, mod_1, 64u);
+ *     q.recv(mq::overloaded {
+ *         [](mq::MsgPtr<ping> m) { ... },
+ *         [](mq::MsgPtr<pong> m) { ... },
+ *     });
+ *
+ * Dispatch is generated from the type list of the queue, so handlers
+ * are called directly and can be inlined into the receive loop.
+ */
+
+#ifndef _MESSAGE_QUEUE_HPP_
+#define _MESSAGE_QUEUE_HPP_
+
+#if __cplusplus < 201703L
+#error "message_queue.hpp requires C++17"
+#endif
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include "message_queue.h"
+
+namespace mq {
+
+/**
+ * Compile-time id of a message type.
+ */
+template <class T>
+inline constexpr int message_id_v = T::message_id;
+
+/**
+ * Memory layout of a typed message.
+ */
+template <class T>
+struct Envelope {
+    message_header_t  header;
+    T                 body;
+};
+
+template <class... Ts>
+struct overloaded : Ts... { using Ts::operator()...; };
+template <class... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+namespace detail {
+
+template <class T>
+constexpr void check_message_type()
+{
+    static_assert(std::is_same_v<decltype(message_id_v<T>), const int>,
+                  "message type needs 'static constexpr int message_id'");
+    static_assert(alignof(T) <= 16,
+                  "message pool chunks are 16-byte aligned");
+    static_assert(std::is_standard_layout_v<Envelope<T>>,
+                  "message type must be standard layout");
+}
+
+template <class... Ts>
+constexpr bool unique_ids()
+{
+    constexpr int ids[] = { message_id_v<Ts>... };
+    for (std::size_t i = 0; i < sizeof...(Ts); i++) {
+        for (std::size_t j = i + 1; j < sizeof...(Ts); j++) {
+            if (ids[i] == ids[j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <class T>
+inline Envelope<T> *envelope(message_header_t *h) noexcept
+{
+    return reinterpret_cast<Envelope<T> *>(h);
+}
+
+} // namespace detail
+
+/**
+ * Move-only owner of a typed message.
+ */
+template <class T>
+class MsgPtr {
+public:
+    MsgPtr() noexcept : env_(nullptr) {}
+
+    /* Take ownership of a message known to hold a T. */
+    explicit MsgPtr(message_header_t *h) noexcept
+        : env_(detail::envelope<T>(h)) {}
+
+    MsgPtr(MsgPtr &&other) noexcept : env_(other.env_)
+    {
+        other.env_ = nullptr;
+    }
+
+    MsgPtr &operator=(MsgPtr &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            env_ = other.env_;
+            other.env_ = nullptr;
+        }
+        return *this;
+    }
+
+    MsgPtr(const MsgPtr &) = delete;
+    MsgPtr &operator=(const MsgPtr &) = delete;
+
+    ~MsgPtr() { reset(); }
+
+    T *get() const noexcept { return env_ ? &env_->body : nullptr; }
+    T &operator*() const noexcept { return env_->body; }
+    T *operator->() const noexcept { return &env_->body; }
+    explicit operator bool() const noexcept { return env_ != nullptr; }
+
+    message_header_t *header() const noexcept
+    {
+        return env_ ? &env_->header : nullptr;
+    }
+
+    int src() const noexcept { return MSG_SRC(&env_->header); }
+
+    /* Give up ownership without destroying the message. */
+    message_header_t *release() noexcept
+    {
+        message_header_t *h = header();
+        env_ = nullptr;
+        return h;
+    }
+
+    /* Destroy and free the message. */
+    void reset() noexcept
+    {
+        if (env_) {
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                env_->body.~T();
+            }
+            message_free(&env_->header);
+            env_ = nullptr;
+        }
+    }
+
+    /*
+     * Send the message on. Ownership moves to the destination on
+     * success; it is kept on failure.
+     */
+    int send(int dest_id, int src_id) noexcept
+    {
+        env_->header.src_id = src_id;
+        if (message_send(&env_->header, dest_id)) {
+            return -1;
+        }
+        env_ = nullptr;
+        return 0;
+    }
+
+    int send(int dest_id) noexcept
+    {
+        return send(dest_id, MSG_SRC(&env_->header));
+    }
+
+private:
+    Envelope<T>  *env_;
+};
+
+/**
+ * Allocate a message and construct a T in place.
+ * Returns an empty MsgPtr if the pool is exhausted or
+ * the message does not fit into a pool chunk.
+ */
+template <class T, class... Args>
+MsgPtr<T> make(int src_id, Args &&...args)
+{
+    detail::check_message_type<T>();
+
+    message_header_t *h = message_new(src_id, message_id_v<T>,
+                                      sizeof(Envelope<T>));
+    if (!h) {
+        return MsgPtr<T>();
+    }
+    try {
+        void *body = &detail::envelope<T>(h)->body;
+        if constexpr (std::is_constructible_v<T, Args &&...>) {
+            ::new (body) T(std::forward<Args>(args)...);
+        } else {
+            /* Aggregates. */
+            ::new (body) T{std::forward<Args>(args)...};
+        }
+    } catch (...) {
+        message_free(h);
+        throw;
+    }
+    return MsgPtr<T>(h);
+}
+
+/**
+ * Construct a T in pool memory and send it.
+ * Return 0 for success; -1 for any failure.
+ */
+template <class T, class... Args>
+int send(int src_id, int dest_id, Args &&...args)
+{
+    MsgPtr<T> m = make<T>(src_id, std::forward<Args>(args)...);
+    if (!m) {
+        return -1;
+    }
+    return m.send(dest_id);
+}
+
+/**
+ * Typed owner of a message queue which receives the types Msgs...
+ * Messages of other types are passed to a handler taking
+ * message_header_t * if there is one, and freed otherwise.
+ */
+template <class... Msgs>
+class Queue {
+    static_assert(sizeof...(Msgs) > 0, "queue needs message types");
+    static_assert(detail::unique_ids<Msgs...>(),
+                  "message ids of a queue must be unique");
+
+public:
+    static constexpr int recv_batch_max = 64;
+
+    /* Create a queue; see message_queue_new. */
+    Queue(int id, uint32_t depth,
+          msg_notif_cb_func_t cb = nullptr, void *arg = nullptr) noexcept
+        : id_(id), owned_(true),
+          que_(message_queue_new(id, depth, cb, arg))
+    {
+        (detail::check_message_type<Msgs>(), ...);
+    }
+
+    /* Use an existing queue without taking ownership. */
+    static Queue attach(message_queue_t *que, int id) noexcept
+    {
+        return Queue(attach_tag(), que, id);
+    }
+
+    Queue(Queue &&other) noexcept
+        : id_(other.id_), owned_(other.owned_), que_(other.que_)
+    {
+        other.que_ = nullptr;
+    }
+
+    Queue(const Queue &) = delete;
+    Queue &operator=(const Queue &) = delete;
+    Queue &operator=(Queue &&) = delete;
+
+    ~Queue()
+    {
+        if (que_ && owned_) {
+            message_queue_free(que_);
+        }
+    }
+
+    explicit operator bool() const noexcept { return que_ != nullptr; }
+    message_queue_t *get() const noexcept { return que_; }
+    int id() const noexcept { return id_; }
+    int fd() const noexcept { return message_queue_get_fd(que_); }
+
+    /* Send a T from this queue's module to dest_id. */
+    template <class T, class... Args>
+    int send(int dest_id, Args &&...args)
+    {
+        return mq::send<T>(id_, dest_id, std::forward<Args>(args)...);
+    }
+
+    /*
+     * Retrieve up to max messages and hand each to the matching
+     * overload of handler. Return the number of messages retrieved.
+     */
+    template <class Handler>
+    int recv(Handler &&handler, int max = recv_batch_max)
+    {
+        message_header_t *batch[recv_batch_max];
+        int n, i = 0;
+
+        n = message_recv_batch(que_, batch,
+                               max < recv_batch_max ? max : recv_batch_max);
+        try {
+            for (; i < n; i++) {
+                dispatch(batch[i], handler);
+            }
+        } catch (...) {
+            /* Drop what the handler did not get to. */
+            for (i++; i < n; i++) {
+                message_free(batch[i]);
+            }
+            message_recv_ack(que_, n);
+            throw;
+        }
+        message_recv_ack(que_, n);
+        return n;
+    }
+
+    /* Hand one message to the matching overload of handler. */
+    template <class Handler>
+    static void dispatch(message_header_t *h, Handler &&handler)
+    {
+        const int type = MSG_TYPE(h);
+        bool done = ((type == message_id_v<Msgs> ?
+                      (handler(MsgPtr<Msgs>(h)), true) : false) || ...);
+        if (!done) {
+            if constexpr (std::is_invocable_v<Handler &,
+                                              message_header_t *>) {
+                handler(h);
+            } else {
+                message_free(h);
+            }
+        }
+    }
+
+private:
+    struct attach_tag {};
+
+    Queue(attach_tag, message_queue_t *que, int id) noexcept
+        : id_(id), owned_(false), que_(que) {}
+
+    int              id_;
+    bool             owned_;
+    message_queue_t  *que_;
+};
+
+/**
+ * Queue<std::variant<A, B>> is Queue<A, B>.
+ */
+template <class... Msgs>
+class Queue<std::variant<Msgs...>> : public Queue<Msgs...> {
+public:
+    using Queue<Msgs...>::Queue;
+};
+
+} // namespace mq
+
+#endif
@@ -0,0 +1,681 @@
+/*
+ * C++20 coroutine layer over message_queue.h.
+ *
+ *     mq::Executor ex;
+ *     mq::AsyncQueue in  = ex.attach(que);        // queue to receive from
+ *     mq::AsyncQueue out = ex.target(mod_1);      // queue to send to
+ *
+ *     mq::Task worker(mq::AsyncQueue in, mq::AsyncQueue out) {
+ *         for (;;) {
+ *             message_header_t *m = co_await in.recv();
+ *             if (co_await out.send(m)) {         // waits while full
+ *                 message_free(m);
+ *             }
+ *         }
+ *     }
+ *
+ *     ex.spawn(worker(in, out));
+ *     ex.run();
+ *
+ * One executor drives any number of coroutines and queues from the
+ * calling thread. eventfd queues are watched through epoll. Queues in
+ * callback mode are created with Executor::notify_cb and share one
+ * eventfd of the executor. Messages are fetched in batches and
+ * waiting coroutines are resumed inline, so a consumer coroutine runs
+ * through a whole batch without returning to the executor.
+ */
+
+#ifndef _MESSAGE_QUEUE_CORO_HPP_
+#define _MESSAGE_QUEUE_CORO_HPP_
+
+#if __cplusplus < 202002L
+#error "message_queue_coro.hpp requires C++20"
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <vector>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "message_queue.h"
+
+namespace mq {
+
+class Executor;
+
+/**
+ * Fire-and-forget coroutine started by Executor::spawn. The frame is
+ * freed when the coroutine returns, or by the executor's destructor
+ * if it is still suspended then.
+ */
+class Task {
+public:
+    struct promise_type {
+        Executor      *ex = nullptr;
+        promise_type  *prev = nullptr;
+        promise_type  *next = nullptr;
+
+        Task get_return_object() noexcept
+        {
+            return Task(std::coroutine_handle<promise_type>::
+                            from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+        ~promise_type();
+    };
+
+    Task(Task &&other) noexcept : h_(other.h_) { other.h_ = nullptr; }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    Task &operator=(Task &&) = delete;
+
+    ~Task()
+    {
+        /* Never spawned. */
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+private:
+    friend class Executor;
+
+    explicit Task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+    std::coroutine_handle<promise_type>  h_;
+};
+
+/**
+ * Messages returned by AsyncQueue::recv_batch.
+ */
+struct Batch {
+    static constexpr int max = 64;
+
+    message_header_t  *msgs[max];
+    int               count = 0;
+
+    message_header_t **begin() noexcept { return msgs; }
+    message_header_t **end() noexcept { return msgs + count; }
+    int size() const noexcept { return count; }
+    message_header_t *operator[](int i) const noexcept { return msgs[i]; }
+};
+
+namespace detail {
+
+struct RecvWaiter {
+    RecvWaiter               *next = nullptr;
+    std::coroutine_handle<>  h;
+    message_header_t         **out = nullptr;
+    int                      want = 0;
+    int                      got = 0;
+    bool                     linked = false;
+};
+
+struct SendWaiter {
+    SendWaiter               *next = nullptr;
+    std::coroutine_handle<>  h;
+    message_header_t         *msg = nullptr;
+    int                      dest = -1;
+    int                      rtn = 0;
+    bool                     linked = false;
+};
+
+/*
+ * State of one queue attached to an executor: waiting receivers and
+ * the messages fetched but not handed out yet.
+ */
+struct Source {
+    message_queue_t   *que = nullptr;
+    int               fd = -1;
+    bool              armed = false;
+    RecvWaiter        *head = nullptr;
+    RecvWaiter        *tail = nullptr;
+    message_header_t  *buf[Batch::max];
+    int               pos = 0;
+    int               count = 0;
+
+    int take(message_header_t **out, int want) noexcept
+    {
+        int n = 0;
+
+        if (pos == count) {
+            pos = count = 0;
+            if (fd == -1) {
+                /* Callback mode: plain ring access, no syscall. */
+                count = message_recv_batch(que, buf, Batch::max);
+            }
+        }
+        while (n < want && pos < count) {
+            out[n++] = buf[pos++];
+        }
+        /* Journaled queues: acknowledge only what a task received. */
+        message_recv_ack(que, n);
+        return n;
+    }
+};
+
+} // namespace detail
+
+/**
+ * Handle used to await on one queue, either as the receiver of an
+ * attached queue or as a sender to a queue id.
+ */
+class AsyncQueue {
+public:
+    class RecvAwaiter;
+    class BatchAwaiter;
+    class SendAwaiter;
+
+    AsyncQueue() noexcept = default;
+
+    /* Wait for one message. */
+    RecvAwaiter recv() noexcept;
+
+    /* Wait for at least one and at most n (<= Batch::max) messages. */
+    BatchAwaiter recv_batch(int n) noexcept;
+
+    /*
+     * Send a message to this queue, waiting while it is full. Yields
+     * -1 if the queue refuses the message for any other reason; the
+     * message then stays with the caller.
+     */
+    SendAwaiter send(message_header_t *msg) noexcept;
+
+    int id() const noexcept { return id_; }
+    message_queue_t *get() const noexcept { return src_ ? src_->que : nullptr; }
+
+private:
+    friend class Executor;
+
+    AsyncQueue(Executor *ex, detail::Source *src, int id) noexcept
+        : ex_(ex), src_(src), id_(id) {}
+
+    Executor        *ex_ = nullptr;
+    detail::Source  *src_ = nullptr;
+    int             id_ = -1;
+};
+
+/**
+ * Single-threaded coroutine executor.
+ */
+class Executor {
+public:
+    /*
+     * retry_ms: how often senders waiting on a full queue retry.
+     * There is no notification for free space in a queue.
+     */
+    explicit Executor(int retry_ms = 1)
+        : retry_ms_(retry_ms)
+    {
+        epoll_event ev = {};
+
+        epfd_ = epoll_create1(EPOLL_CLOEXEC);
+        efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        if (epfd_ == -1 || efd_ == -1 ||
+            epoll_ctl(epfd_, EPOLL_CTL_ADD, efd_, &ev)) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    ~Executor()
+    {
+        while (tasks_) {
+            /* Unlinks itself through ~promise_type. */
+            std::coroutine_handle<Task::promise_type>::
+                from_promise(*tasks_).destroy();
+        }
+        for (auto &s : sources_) {
+            for (; s->pos < s->count; s->pos++) {
+                message_free(s->buf[s->pos]);
+            }
+        }
+        close(efd_);
+        close(epfd_);
+    }
+
+    /*
+     * Notification callback for queues in callback mode:
+     *     message_queue_new(id, depth, mq::Executor::notify_cb, &ex);
+     * Safe to be called from any thread.
+     */
+    static void notify_cb(message_queue_t *, void *arg) noexcept
+    {
+        Executor *ex = static_cast<Executor *>(arg);
+        uint64_t one = 1;
+
+        if (!ex->pending_.exchange(true)) {
+            (void)!write(ex->efd_, &one, sizeof(one));
+        }
+    }
+
+    /*
+     * Receive from a queue owned by the caller. Futex queues cannot be
+     * watched and are rejected.
+     */
+    AsyncQueue attach(message_queue_t *que, int id = -1)
+    {
+        if (message_queue_is_futex(que)) {
+            throw std::system_error(EINVAL, std::generic_category());
+        }
+        auto src = std::make_unique<detail::Source>();
+
+        src->que = que;
+        src->fd = message_queue_get_fd(que);
+        if (src->fd != -1) {
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = src.get();
+            if (epoll_ctl(epfd_, EPOLL_CTL_ADD, src->fd, &ev)) {
+                throw std::system_error(errno, std::generic_category());
+            }
+            src->armed = true;
+        }
+        sources_.push_back(std::move(src));
+        return AsyncQueue(this, sources_.back().get(), id);
+    }
+
+    /* Send to a queue id. */
+    AsyncQueue target(int dest_id) noexcept
+    {
+        return AsyncQueue(this, nullptr, dest_id);
+    }
+
+    /* Start a coroutine on the next iteration of run(). */
+    void spawn(Task task)
+    {
+        auto h = task.h_;
+        task.h_ = nullptr;
+
+        h.promise().ex = this;
+        h.promise().next = tasks_;
+        if (tasks_) {
+            tasks_->prev = &h.promise();
+        }
+        tasks_ = &h.promise();
+        ready_.push_back(h);
+    }
+
+    /* Run until stop(). */
+    void run()
+    {
+        epoll_event evs[32];
+        uint64_t num;
+        int n, i;
+
+        stop_ = false;
+        while (!stop_) {
+            run_ready();
+            if (stop_) {
+                break;
+            }
+
+            n = epoll_wait(epfd_, evs, 32, !ready_.empty() ? 0 :
+                                           senders_ ? retry_ms_ : -1);
+            for (i = 0; i < n; i++) {
+                if (!evs[i].data.ptr) {
+                    (void)!read(efd_, &num, sizeof(num));
+                    pending_.store(false);
+                    for (auto &s : sources_) {
+                        if (s->fd == -1) {
+                            serve(*s);
+                        }
+                    }
+                } else {
+                    serve(*static_cast<detail::Source *>(evs[i].data.ptr));
+                }
+            }
+            retry_senders();
+        }
+    }
+
+    /* Make run() return. Safe to be called from any thread. */
+    void stop() noexcept
+    {
+        uint64_t one = 1;
+
+        stop_ = true;
+        (void)!write(efd_, &one, sizeof(one));
+    }
+
+private:
+    friend class AsyncQueue;
+    friend struct Task::promise_type;
+
+    /*
+     * Resume the ready coroutines. Swapping with running_ keeps the
+     * capacity of both vectors, so no allocation once warmed up.
+     */
+    void run_ready()
+    {
+        running_.swap(ready_);
+        for (auto h : running_) {
+            h.resume();
+        }
+        running_.clear();
+    }
+
+    /*
+     * Hand fetched messages to waiting receivers in order, resuming
+     * each one inline.
+     */
+    void serve(detail::Source &s)
+    {
+        detail::RecvWaiter *w;
+
+        while ((w = s.head)) {
+            if (s.pos == s.count) {
+                s.pos = 0;
+                s.count = message_recv_batch(s.que, s.buf, Batch::max);
+                if (!s.count) {
+                    break;
+                }
+            }
+            s.head = w->next;
+            if (!s.head) {
+                s.tail = nullptr;
+            }
+            w->linked = false;
+            w->got = s.take(w->out, w->want);
+            w->h.resume();
+        }
+
+        /*
+         * Stop watching a queue nobody waits on; the eventfd stays
+         * readable while messages are left.
+         */
+        if (!s.head && s.armed) {
+            epoll_event ev = {};
+            ev.data.ptr = &s;
+            (void)epoll_ctl(epfd_, EPOLL_CTL_MOD, s.fd, &ev);
+            s.armed = false;
+        }
+    }
+
+    void add_waiter(detail::Source &s, detail::RecvWaiter &w)
+    {
+        w.next = nullptr;
+        w.linked = true;
+        if (s.tail) {
+            s.tail->next = &w;
+        } else {
+            s.head = &w;
+        }
+        s.tail = &w;
+
+        if (s.fd != -1 && !s.armed) {
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = &s;
+            (void)epoll_ctl(epfd_, EPOLL_CTL_MOD, s.fd, &ev);
+            s.armed = true;
+        }
+    }
+
+    static void remove_waiter(detail::Source &s, detail::RecvWaiter &w)
+    {
+        detail::RecvWaiter **pp, *prev = nullptr;
+
+        for (pp = &s.head; *pp; prev = *pp, pp = &(*pp)->next) {
+            if (*pp == &w) {
+                *pp = w.next;
+                if (s.tail == &w) {
+                    s.tail = prev;
+                }
+                break;
+            }
+        }
+        w.linked = false;
+    }
+
+    bool sender_blocked(int dest) const noexcept
+    {
+        for (auto *w = senders_; w; w = w->next) {
+            if (w->dest == dest) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void add_sender(detail::SendWaiter &w) noexcept
+    {
+        detail::SendWaiter **pp = &senders_;
+
+        while (*pp) {
+            pp = &(*pp)->next;
+        }
+        w.next = nullptr;
+        w.linked = true;
+        *pp = &w;
+    }
+
+    void remove_sender(detail::SendWaiter &w) noexcept
+    {
+        for (auto **pp = &senders_; *pp; pp = &(*pp)->next) {
+            if (*pp == &w) {
+                *pp = w.next;
+                break;
+            }
+        }
+        w.linked = false;
+    }
+
+    /*
+     * Retry blocked senders in order. A full queue blocks the later
+     * senders to it so that order is kept. A sender whose message is
+     * refused for another reason is resumed with the failure.
+     */
+    void retry_senders()
+    {
+        detail::SendWaiter **pp = &senders_, *w;
+        bool skip;
+
+        full_.clear();
+        while ((w = *pp)) {
+            skip = false;
+            for (int d : full_) {
+                skip = skip || d == w->dest;
+            }
+            if (!skip) {
+                w->rtn = message_send(w->msg, w->dest);
+                if (!w->rtn || errno != EAGAIN) {
+                    *pp = w->next;
+                    w->linked = false;
+                    ready_.push_back(w->h);
+                    continue;
+                }
+                full_.push_back(w->dest);
+            }
+            pp = &w->next;
+        }
+    }
+
+    int                                    epfd_ = -1;
+    int                                    efd_ = -1;
+    int                                    retry_ms_;
+    std::atomic<bool>                      stop_ {false};
+    std::atomic<bool>                      pending_ {false};
+    std::vector<std::unique_ptr<detail::Source>> sources_;
+    std::vector<std::coroutine_handle<>>   ready_;
+    std::vector<std::coroutine_handle<>>   running_;
+    std::vector<int>                       full_;
+    detail::SendWaiter                     *senders_ = nullptr;
+    Task::promise_type                     *tasks_ = nullptr;
+};
+
+inline Task::promise_type::~promise_type()
+{
+    if (ex) {
+        if (prev) {
+            prev->next = next;
+        } else {
+            ex->tasks_ = next;
+        }
+        if (next) {
+            next->prev = prev;
+        }
+    }
+}
+
+class AsyncQueue::RecvAwaiter {
+public:
+    explicit RecvAwaiter(AsyncQueue q) noexcept : q_(q)
+    {
+        w_.out = &msg_;
+        w_.want = 1;
+    }
+
+    RecvAwaiter(const RecvAwaiter &) = delete;
+    RecvAwaiter &operator=(const RecvAwaiter &) = delete;
+
+    ~RecvAwaiter()
+    {
+        if (w_.linked) {
+            Executor::remove_waiter(*q_.src_, w_);
+        }
+    }
+
+    bool await_ready() noexcept
+    {
+        return !q_.src_->head && q_.src_->take(&msg_, 1);
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        w_.h = h;
+        q_.ex_->add_waiter(*q_.src_, w_);
+    }
+
+    message_header_t *await_resume() noexcept { return msg_; }
+
+private:
+    AsyncQueue          q_;
+    detail::RecvWaiter  w_;
+    message_header_t    *msg_ = nullptr;
+};
+
+class AsyncQueue::BatchAwaiter {
+public:
+    BatchAwaiter(AsyncQueue q, int n) noexcept : q_(q)
+    {
+        w_.out = batch_.msgs;
+        w_.want = n < 1 ? 1 : (n > Batch::max ? Batch::max : n);
+    }
+
+    BatchAwaiter(const BatchAwaiter &) = delete;
+    BatchAwaiter &operator=(const BatchAwaiter &) = delete;
+
+    ~BatchAwaiter()
+    {
+        if (w_.linked) {
+            Executor::remove_waiter(*q_.src_, w_);
+        }
+    }
+
+    bool await_ready() noexcept
+    {
+        if (q_.src_->head) {
+            return false;
+        }
+        batch_.count = q_.src_->take(batch_.msgs, w_.want);
+        return batch_.count > 0;
+    }
+
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        w_.h = h;
+        q_.ex_->add_waiter(*q_.src_, w_);
+    }
+
+    Batch await_resume() noexcept
+    {
+        if (!batch_.count) {
+            batch_.count = w_.got;
+        }
+        return batch_;
+    }
+
+private:
+    AsyncQueue          q_;
+    detail::RecvWaiter  w_;
+    Batch               batch_;
+};
+
+class AsyncQueue::SendAwaiter {
+public:
+    SendAwaiter(AsyncQueue q, message_header_t *msg) noexcept : q_(q)
+    {
+        w_.msg = msg;
+        w_.dest = q.id_;
+    }
+
+    SendAwaiter(const SendAwaiter &) = delete;
+    SendAwaiter &operator=(const SendAwaiter &) = delete;
+
+    ~SendAwaiter()
+    {
+        /* Coroutine destroyed while waiting: the message is dropped. */
+        if (w_.linked) {
+            q_.ex_->remove_sender(w_);
+            message_free(w_.msg);
+        }
+    }
+
+    bool await_ready() noexcept
+    {
+        if (q_.ex_->sender_blocked(w_.dest)) {
+            return false;
+        }
+        w_.rtn = message_send(w_.msg, w_.dest);
+        return !w_.rtn || errno != EAGAIN;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        w_.h = h;
+        q_.ex_->add_sender(w_);
+    }
+
+    /*
+     * 0 once the message is sent; -1 if the queue refused it other
+     * than for being full, in which case the caller still owns it.
+     */
+    int await_resume() noexcept { return w_.rtn; }
+
+private:
+    AsyncQueue          q_;
+    detail::SendWaiter  w_;
+};
+
+inline AsyncQueue::RecvAwaiter AsyncQueue::recv() noexcept
+{
+    return RecvAwaiter(*this);
+}
+
+inline AsyncQueue::BatchAwaiter AsyncQueue::recv_batch(int n) noexcept
+{
+    return BatchAwaiter(*this, n);
+}
+
+inline AsyncQueue::SendAwaiter AsyncQueue::send(message_header_t *msg) noexcept
+{
+    return SendAwaiter(*this, msg);
+}
+
+} // namespace mq
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _MESSAGE_RUNTIME_H_
+#define _MESSAGE_RUNTIME_H_
+
+#include "message_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Worker loop flavours.
+ */
+enum {
+    /* Sleep in epoll_wait on the eventfds of the worker's queues. */
+    MSG_RUNTIME_EPOLL = 0,
+    /* Spin over the worker's queues. No syscall per message. */
+    MSG_RUNTIME_BUSY_POLL
+};
+
+/**
+ * Structure which describes one module: a queue and its handler.
+ */
+typedef struct _message_module_config_t {
+    int                    queue_id;
+    uint32_t               queue_depth;
+    msg_handler_cb_func_t  handler;
+    void                   *arg;
+} message_module_config_t;
+
+typedef void (*msg_worker_cb_func_t)(int worker, void *arg);
+
+/**
+ * Structure which describes one worker thread.
+ */
+typedef struct _message_worker_config_t {
+    /* CPU to pin the worker to, below CPU_SETSIZE; -1 for no pinning. */
+    int                            cpu;
+    /* Modules served by this worker. */
+    const message_module_config_t  *modules;
+    int                            module_num;
+    /*
+     * Optional. init_cb runs on the worker after its queues are
+     * created and before message_runtime_start returns. fini_cb runs
+     * after the worker has drained its queues on stop.
+     */
+    msg_worker_cb_func_t           init_cb;
+    msg_worker_cb_func_t           fini_cb;
+    void                           *cb_arg;
+} message_worker_config_t;
+
+/**
+ * Structure which configures a runtime.
+ */
+typedef struct _message_runtime_config_t {
+    const message_worker_config_t  *workers;
+    int                            worker_num;
+    /* MSG_RUNTIME_EPOLL or MSG_RUNTIME_BUSY_POLL. */
+    int                            mode;
+} message_runtime_config_t;
+
+typedef struct _message_runtime_t message_runtime_t;
+
+/**
+ * Start worker threads. Each worker is pinned as configured, creates
+ * the queues of its modules and runs init_cb. The call returns once
+ * every worker is ready to receive, so messages can be sent to any
+ * module right away. message_queue_init must be called first.
+ * Params
+ *     const message_runtime_config_t * : runtime configuration.
+ *                                        Copied; need not be kept.
+ * Return
+ *     message_runtime_t * : the runtime or NULL on any failure.
+ */
+message_runtime_t *message_runtime_start (const message_runtime_config_t *);
+
+/**
+ * Stop a runtime. Workers keep handling messages, including those
+ * sent by handlers of other workers meanwhile, until all queues are
+ * found empty together, or for a bounded number of rounds when
+ * handlers keep forwarding. Then fini_cb runs and the threads exit.
+ * Queues are destroyed, and messages left in them are freed.
+ * Params
+ *     message_runtime_t * : runtime to stop.
+ * Return
+ *     int                 : always 0
+ */
+int message_runtime_stop (message_runtime_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
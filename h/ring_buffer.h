@@ -7,9 +7,14 @@
 #define _RING_BUFFER_H_
 
 #include <stdlib.h>
+#include <stdint.h>
 
 /**
  * Structure which holds a ring buffer.
+ * One producer (or producers serialized by a lock) and one consumer.
+ * head is published with release and read with acquire, and so is
+ * tail, so that a slot is written before it is seen and read before
+ * it is reused.
  */
 typedef struct _ring_buffer_t {
     /*  mask. */
@@ -29,7 +34,8 @@ typedef struct _ring_buffer_t {
  * @return 1 if empty; 0 otherwise.
  */
 static inline int ring_buffer_is_empty(ring_buffer_t *ring) {
-    return (ring->head == ring->tail);
+    return (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
 }
 
 /**
@@ -37,7 +43,9 @@ static inline int ring_buffer_is_empty(ring_buffer_t *ring) {
  * @return 1 if full; 0 otherwise.
  */
 static inline int ring_buffer_is_full(ring_buffer_t *ring) {
-    return (((ring->head - ring->tail) & ring->mask) == ring->mask);
+    return (((__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+              __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) & ring->mask)
+            == ring->mask);
 }
 
 /**
@@ -78,7 +86,8 @@ static inline int ring_buffer_enq(ring_buffer_t *ring, void *data)
     }
 
     ring->buffer[ring->head] = data;
-    ring->head = ((ring->head + 1) & ring->mask);
+    __atomic_store_n(&ring->head, (ring->head + 1) & ring->mask,
+                     __ATOMIC_RELEASE);
     return 0;
 }
 
@@ -93,7 +102,8 @@ static inline void *ring_buffer_deq(ring_buffer_t *ring)
     }
 
     elem = ring->buffer[ring->tail];
-    ring->tail = ((ring->tail + 1) & ring->mask);
+    __atomic_store_n(&ring->tail, (ring->tail + 1) & ring->mask,
+                     __ATOMIC_RELEASE);
     return elem;
 }
 
@@ -103,7 +113,8 @@ static inline void *ring_buffer_deq(ring_buffer_t *ring)
  */
 static inline uint32_t ring_buffer_num_items(ring_buffer_t *ring)
 {
-    return ((ring->head - ring->tail) & ring->mask);
+    return ((__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+             __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) & ring->mask);
 }
 
 #endif 
@@ -0,0 +1,113 @@
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define SPSC_CACHE_LINE   64
+
+/**
+ * Structure which holds a single-producer single-consumer ring.
+ * Producer and consumer indexes live on separate cache lines, and
+ * each side caches the other's index so that it only reads the
+ * remote line when the ring looks full (or empty).
+ */
+typedef struct _spsc_ring_t {
+    /* mask. Read-only after creation. */
+    uint32_t mask __attribute__((aligned(SPSC_CACHE_LINE)));
+    /* Index of head(enq), producer side. Free running. */
+    uint32_t head __attribute__((aligned(SPSC_CACHE_LINE)));
+    uint32_t tail_cache;
+    /*
+     * Free for the user, e.g. a wakeup flag. Shares the producer's
+     * cache line.
+     */
+    uint32_t parked;
+    /* Index of tail(deq), consumer side. Free running. */
+    uint32_t tail __attribute__((aligned(SPSC_CACHE_LINE)));
+    uint32_t head_cache;
+    /* Buffer memory. */
+    void  *buffer[0] __attribute__((aligned(SPSC_CACHE_LINE)));
+} spsc_ring_t;
+
+/**
+ * Initialze a new ring.
+ * Ring size must be power of 2.
+ */
+static inline spsc_ring_t *spsc_ring_new(uint32_t size)
+{
+    spsc_ring_t *ring;
+    size_t len;
+
+    if (!size || (size & (size-1))) {
+        return NULL;
+    }
+    len = sizeof(spsc_ring_t) + size * sizeof(void*);
+    len = (len + SPSC_CACHE_LINE - 1) & ~(size_t)(SPSC_CACHE_LINE - 1);
+    ring = (spsc_ring_t *)aligned_alloc(SPSC_CACHE_LINE, len);
+    if (ring) {
+        ring->mask = size - 1;
+        ring->head = ring->tail = 0;
+        ring->tail_cache = ring->head_cache = 0;
+        ring->parked = 0;
+    }
+    return ring;
+}
+
+/**
+ * Free a ring.
+ */
+static inline void spsc_ring_free(spsc_ring_t *ring)
+{
+    free(ring);
+}
+
+/**
+ * Adds an element. Producer only.
+ * @return 0 on success; -1 if the ring is full.
+ */
+static inline int spsc_ring_enq(spsc_ring_t *ring, void *data)
+{
+    uint32_t head = ring->head;
+
+    if (head - ring->tail_cache > ring->mask) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_cache > ring->mask) {
+            return -1;
+        }
+    }
+    ring->buffer[head & ring->mask] = data;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Returns the oldest element or NULL if empty. Consumer only.
+ */
+static inline void *spsc_ring_deq(spsc_ring_t *ring)
+{
+    uint32_t tail = ring->tail;
+    void *elem;
+
+    if (tail == ring->head_cache) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == ring->head_cache) {
+            return NULL;
+        }
+    }
+    elem = ring->buffer[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return elem;
+}
+
+/**
+ * Returns the number of items in a ring. Exact on the consumer side,
+ * a snapshot elsewhere.
+ */
+static inline uint32_t spsc_ring_num_items(spsc_ring_t *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif
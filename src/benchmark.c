@@ -0,0 +1,191 @@
+/*
+ * Wakeup benchmark of the eventfd and futex notification backends.
+ *
+ *   ping-pong : two threads bounce one message; round-trip latency.
+ *   stream    : one producer, one consumer; throughput, and context
+ *               switches per message as a measure of sleeps and
+ *               wakeups.
+ *
+ * Both consumers block in message_recv_wait. Exact syscall counts can
+ * be taken with 'strace -c -f ./benchmark'.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "message_queue.h"
+
+enum {
+    que_ping = 0,
+    que_pong,
+    que_stream,
+    que_max
+};
+
+#define PINGPONG_ROUNDS   100000
+#define STREAM_MESSAGES   2000000
+#define STREAM_DEPTH      1024
+
+typedef struct _bench_ctx_t {
+    message_queue_t  *ping;
+    message_queue_t  *pong;
+    message_queue_t  *stream;
+    uint64_t         received;
+    uint64_t         done;
+    long             csw;
+} bench_ctx_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long thread_csw(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void send_retry(int src, int dest)
+{
+    message_header_t *m;
+
+    while (!(m = message_new(src, 0, sizeof(message_header_t)))) {
+        sched_yield();
+    }
+    while (message_send(m, dest)) {
+        sched_yield();
+    }
+}
+
+static void
+pong_handler(message_queue_t *que, message_header_t *m, void *arg)
+{
+    bench_ctx_t *ctx = (bench_ctx_t *)arg;
+
+    UNUSED(que);
+    if (MSG_TYPE(m)) {
+        ctx->done = 1;
+        message_free(m);
+        return;
+    }
+    if (message_send(m, que_pong)) {
+        message_free(m);
+    }
+}
+
+static void *pong_thread(void *arg)
+{
+    bench_ctx_t *ctx = (bench_ctx_t *)arg;
+
+    while (!ctx->done) {
+        message_recv_wait(ctx->ping, pong_handler, ctx, -1);
+    }
+    return NULL;
+}
+
+static void
+count_handler(message_queue_t *que, message_header_t *m, void *arg)
+{
+    UNUSED(que);
+    ((bench_ctx_t *)arg)->received++;
+    message_free(m);
+}
+
+static void *stream_thread(void *arg)
+{
+    bench_ctx_t *ctx = (bench_ctx_t *)arg;
+    long csw = thread_csw();
+
+    while (ctx->received < STREAM_MESSAGES) {
+        message_recv_wait(ctx->stream, count_handler, ctx, -1);
+    }
+    ctx->csw = thread_csw() - csw;
+    return NULL;
+}
+
+static int run(const char *name, msg_notif_cb_func_t notif)
+{
+    static uint64_t rtt[PINGPONG_ROUNDS];
+    bench_ctx_t ctx;
+    pthread_t tid;
+    uint64_t start, sum = 0;
+    long csw;
+    int i;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ping = message_queue_new(que_ping, 16, notif, NULL);
+    ctx.pong = message_queue_new(que_pong, 16, notif, NULL);
+    ctx.stream = message_queue_new(que_stream, STREAM_DEPTH, notif, NULL);
+    if (!ctx.ping || !ctx.pong || !ctx.stream) {
+        printf("%s: queue creation failed\n", name);
+        return -1;
+    }
+
+    pthread_create(&tid, NULL, pong_thread, &ctx);
+    for (i = 0; i < PINGPONG_ROUNDS; i++) {
+        start = now_ns();
+        send_retry(que_pong, que_ping);
+        while (message_recv_wait(ctx.pong, count_handler, &ctx, -1) <= 0);
+        rtt[i] = now_ns() - start;
+        sum += rtt[i];
+    }
+    message_send(message_new(que_pong, 1, sizeof(message_header_t)),
+                 que_ping);
+    pthread_join(tid, NULL);
+    qsort(rtt, PINGPONG_ROUNDS, sizeof(rtt[0]), cmp_u64);
+    printf("%-8s ping-pong  rtt avg %6lu ns  p50 %6lu ns  p99 %6lu ns\n",
+           name, sum / PINGPONG_ROUNDS, rtt[PINGPONG_ROUNDS / 2],
+           rtt[PINGPONG_ROUNDS * 99 / 100]);
+
+    ctx.received = 0;
+    pthread_create(&tid, NULL, stream_thread, &ctx);
+    csw = thread_csw();
+    start = now_ns();
+    for (i = 0; i < STREAM_MESSAGES; i++) {
+        send_retry(que_max, que_stream);
+    }
+    pthread_join(tid, NULL);
+    start = now_ns() - start;
+    csw = thread_csw() - csw + ctx.csw;
+    printf("%-8s stream     %6.2f Mmsg/s  %.4f context switches/msg\n",
+           name, STREAM_MESSAGES * 1e3 / start,
+           (double)csw / STREAM_MESSAGES);
+
+    message_queue_free(ctx.ping);
+    message_queue_free(ctx.pong);
+    message_queue_free(ctx.stream);
+    return 0;
+}
+
+int main(void)
+{
+    if (message_queue_init(que_max + 1, 64)) {
+        printf("message_queue_init failed\n");
+        return 1;
+    }
+    if (run("eventfd", NULL) || run("futex", MSG_NOTIF_FUTEX)) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2024  sh4run
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reference-counted external buffers.
+ *
+ * Large payloads stay in their own memory and are attached to a
+ * message by reference, so a send moves a pointer instead of copying
+ * the payload. Each attachment holds one reference; the memory is
+ * released with the last one, whichever thread drops it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "message_queue.h"
+#include "message_buf.h"
+
+#define BUF_HUGEPAGE_SIZE   (2UL << 20)
+#define SG_INIT_SIZE        4
+
+struct _message_buf_t {
+    void                    *base;
+    size_t                  length;
+    uint32_t                refcnt;
+    msg_buf_release_func_t  release_cb;
+    void                    *release_arg;
+    /* Mapped length for buffers from message_buf_new. */
+    size_t                  map_len;
+};
+
+static void
+message_buf_unmap(void *base, size_t len, void *arg)
+{
+    message_buf_t *buf = (message_buf_t *)arg;
+
+    UNUSED(len);
+    munmap(base, buf->map_len);
+}
+
+message_buf_t *message_buf_new(size_t len)
+{
+    message_buf_t *buf;
+    size_t page, map_len;
+    void *addr;
+
+    if (!len) {
+        return NULL;
+    }
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    map_len = (len + page - 1) & ~(page - 1);
+    addr = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    if (map_len >= BUF_HUGEPAGE_SIZE) {
+        (void)madvise(addr, map_len, MADV_HUGEPAGE);
+    }
+
+    buf = message_buf_wrap(addr, len, message_buf_unmap, NULL);
+    if (!buf) {
+        munmap(addr, map_len);
+        return NULL;
+    }
+    buf->release_arg = buf;
+    buf->map_len = map_len;
+    return buf;
+}
+
+message_buf_t *message_buf_wrap(void *base, size_t len,
+                                msg_buf_release_func_t release_cb, void *arg)
+{
+    message_buf_t *buf;
+
+    if (!base || !len) {
+        return NULL;
+    }
+    buf = (message_buf_t *)malloc(sizeof(message_buf_t));
+    if (!buf) {
+        return NULL;
+    }
+    buf->base = base;
+    buf->length = len;
+    buf->refcnt = 1;
+    buf->release_cb = release_cb;
+    buf->release_arg = arg;
+    buf->map_len = 0;
+    return buf;
+}
+
+void message_buf_get(message_buf_t *buf)
+{
+    __atomic_fetch_add(&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void message_buf_put(message_buf_t *buf)
+{
+    if (__atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (buf->release_cb) {
+        buf->release_cb(buf->base, buf->length, buf->release_arg);
+    }
+    free(buf);
+}
+
+void *message_buf_data(message_buf_t *buf, size_t *len)
+{
+    if (len) {
+        *len = buf->length;
+    }
+    return buf->base;
+}
+
+int message_attach(message_header_t *msg, message_buf_t *buf,
+                   size_t offset, size_t length)
+{
+    message_sg_t **slot = message_sg_slot(msg);
+    message_sg_t *sg = *slot, *inl, *heap;
+    uint32_t size;
+
+    if (!buf || offset > buf->length || length > buf->length - offset) {
+        return -1;
+    }
+    inl = message_sg_inline(msg, &size);
+    if (!sg && inl) {
+        sg = inl;
+        sg->count = 0;
+        sg->size = size;
+        *slot = sg;
+    } else if (!sg || sg->count == sg->size) {
+        size = sg ? sg->size * 2 : SG_INIT_SIZE;
+        if (sg && sg != inl) {
+            sg = (message_sg_t *)realloc(sg, MSG_SG_SIZE(size));
+        } else {
+            /* First heap list, or moving off the inline area. */
+            heap = (message_sg_t *)malloc(MSG_SG_SIZE(size));
+            if (heap) {
+                if (sg) {
+                    memcpy(heap, sg, MSG_SG_SIZE(sg->count));
+                } else {
+                    heap->count = 0;
+                }
+            }
+            sg = heap;
+        }
+        if (!sg) {
+            return -1;
+        }
+        sg->size = size;
+        *slot = sg;
+    }
+    sg->entry[sg->count].buf = buf;
+    sg->entry[sg->count].offset = offset;
+    sg->entry[sg->count].length = length;
+    sg->count++;
+    return 0;
+}
+
+int message_buf_count(message_header_t *msg)
+{
+    message_sg_t *sg = *message_sg_slot(msg);
+
+    return sg ? (int)sg->count : 0;
+}
+
+message_buf_t *message_buf_at(message_header_t *msg, int idx,
+                              struct iovec *iov)
+{
+    message_sg_entry_t *e;
+
+    if (idx < 0 || idx >= message_buf_count(msg)) {
+        return NULL;
+    }
+    e = &(*message_sg_slot(msg))->entry[idx];
+    if (iov) {
+        iov->iov_base = (uint8_t *)e->buf->base + e->offset;
+        iov->iov_len = e->length;
+    }
+    return e->buf;
+}
+
+int message_get_iov(message_header_t *msg, struct iovec *iov, int num)
+{
+    int i, count = message_buf_count(msg);
+
+    if (count > num) {
+        count = num;
+    }
+    for (i = 0; i < count; i++) {
+        (void)message_buf_at(msg, i, &iov[i]);
+    }
+    return count;
+}
+
+void message_sg_free(message_header_t *msg)
+{
+    message_sg_t *sg = *message_sg_slot(msg);
+    uint32_t i, size;
+
+    for (i = 0; i < sg->count; i++) {
+        message_buf_put(sg->entry[i].buf);
+    }
+    if (sg != message_sg_inline(msg, &size)) {
+        free(sg);
+    }
+}
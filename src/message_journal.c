@@ -0,0 +1,858 @@
+/*
+ * Copyright (c) 2024  sh4run
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Persistent journal of a message queue.
+ *
+ * Every message sent to a journaled queue is copied into a memory-mapped
+ * append-only segment file. Segments are flushed to disk in groups, either
+ * by a background thread on a fixed interval or on demand. The consumer
+ * acknowledges messages as they are delivered; the acknowledge point lives
+ * in a small mapped meta file. Segments whose messages are all acknowledged
+ * are removed during a flush.
+ *
+ * The flusher keeps the next segment created and populated ahead of time.
+ * A producer filling a segment only swaps in the spare and queues the full
+ * segment, which the flusher then syncs and unmaps, so no disk flush runs
+ * under the queue write lock.
+ *
+ * Layout of <dir>:
+ *     q<id>.meta           journal_meta_t, one page.
+ *     q<id>-<seg>.log      journal_seg_hdr_t followed by journal_rec_t's.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "message_journal.h"
+
+#define JOURNAL_META_MAGIC     0x4A4D4554
+#define JOURNAL_SEG_MAGIC      0x4A534547
+#define JOURNAL_DEF_SEG_SIZE   (16 << 20)
+#define JOURNAL_PATH_MAX       512
+
+#define JOURNAL_ALIGN(x)       (((x) + 7) & ~7U)
+
+typedef struct _journal_meta_t {
+    uint32_t   magic;
+    uint32_t   first_seg;
+    uint64_t   ack_seq;
+} journal_meta_t;
+
+typedef struct _journal_seg_hdr_t {
+    uint32_t   magic;
+    uint32_t   seg;
+    uint64_t   first_seq;
+} journal_seg_hdr_t;
+
+typedef struct _journal_rec_t {
+    uint32_t   length;
+    uint32_t   csum;
+    uint64_t   seq;
+    uint8_t    data[0];
+} journal_rec_t;
+
+#define JREC_SIZE(len)   JOURNAL_ALIGN(sizeof(journal_rec_t) + (len))
+#define JSEG_HDR_SIZE    JOURNAL_ALIGN(sizeof(journal_seg_hdr_t))
+
+/**
+ * Structure which holds a full segment waiting for its last sync.
+ */
+typedef struct _journal_seg_t {
+    struct _journal_seg_t  *next;
+    uint32_t               seg;
+    uint32_t               end;
+    int                    fd;
+    uint8_t                *base;
+} journal_seg_t;
+
+/**
+ * Structure which holds a queue journal.
+ */
+struct _message_journal_t {
+    int32_t          que_id;
+    int32_t          sync_mode;
+    uint32_t         seg_size;
+    uint32_t         page_size;
+    uint32_t         flush_ms;
+    char             dir[JOURNAL_PATH_MAX];
+
+    journal_meta_t   *meta;
+    int              meta_fd;
+    uint64_t         synced_ack;
+
+    /* Writer side. Protected by the queue write lock. */
+    uint32_t         cur_seg;
+    int              seg_fd;
+    uint8_t          *seg_base;
+    uint32_t         write_off;
+    uint32_t         pending;
+    uint64_t         next_seq;
+
+    /*
+     * cur_seg/seg_fd/seg_base, a reset of write_off, the spare segment
+     * and the retired list change under seg_lock. It is only held for
+     * pointer swaps.
+     */
+    pthread_mutex_t  seg_lock;
+    int              spare_fd;
+    uint8_t          *spare_base;
+    journal_seg_t    *retired;
+    journal_seg_t    **retired_tail;
+
+    /*
+     * Flush side. Serializes syncs, spare creation and the release of
+     * retired segments.
+     */
+    pthread_mutex_t  sync_lock;
+    uint32_t         synced_seg;
+    uint32_t         synced_off;
+
+    /* Replay cursor. Only records below replay_end are replayed. */
+    int              replay_fd;
+    uint32_t         replay_seg;
+    uint32_t         replay_off;
+    uint32_t         replay_size;
+    uint64_t         replay_seq;
+    uint64_t         replay_end;
+
+    /* Group commit thread. */
+    pthread_t        flusher;
+    pthread_mutex_t  flush_lock;
+    pthread_cond_t   flush_cond;
+    int              flusher_running;
+    int              kick;
+    int              stop;
+};
+
+#define JOURNAL_HASH_MUL       0xff51afd7ed558ccdULL
+
+/*
+ * Hash record data a word at a time. Producers hash a message before
+ * taking the queue lock; only journal_csum runs under it.
+ */
+static uint64_t
+journal_hash(const uint8_t *p, uint32_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * JOURNAL_HASH_MUL;
+        h ^= h >> 32;
+    }
+    if (i < len) {
+        w = 0;
+        memcpy(&w, p + i, len - i);
+        h = (h ^ w) * JOURNAL_HASH_MUL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+/*
+ * Bind a data hash to the sequence number of its record.
+ */
+static uint32_t
+journal_csum(uint64_t hash, uint64_t seq)
+{
+    hash = (hash ^ seq) * JOURNAL_HASH_MUL;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/*
+ * Number of bytes of a message kept in its record.
+ */
+static inline uint32_t
+journal_rec_len(const message_header_t *m)
+{
+    return MSG_SIZE(m) > (int32_t)sizeof(*m) ? (uint32_t)MSG_SIZE(m)
+                                              : sizeof(*m);
+}
+
+static void
+journal_seg_path(message_journal_t *j, uint32_t seg, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/q%d-%08x.log", j->dir, j->que_id, seg);
+}
+
+static int
+journal_sync_range(message_journal_t *j, int fd, void *addr, size_t len)
+{
+    if (j->sync_mode == MSG_JOURNAL_FDATASYNC) {
+        return fdatasync(fd);
+    }
+    return msync(addr, len, MS_SYNC);
+}
+
+static int
+journal_meta_open(message_journal_t *j)
+{
+    char path[JOURNAL_PATH_MAX + 32];
+    struct stat st;
+    void *addr;
+
+    snprintf(path, sizeof(path), "%s/q%d.meta", j->dir, j->que_id);
+    j->meta_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (j->meta_fd == -1) {
+        return -1;
+    }
+    if (fstat(j->meta_fd, &st)) {
+        return -1;
+    }
+    if (st.st_size < j->page_size &&
+        ftruncate(j->meta_fd, j->page_size)) {
+        return -1;
+    }
+    addr = mmap(NULL, j->page_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, j->meta_fd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    j->meta = (journal_meta_t *)addr;
+    if (j->meta->magic != JOURNAL_META_MAGIC) {
+        j->meta->first_seg = 0;
+        j->meta->ack_seq = 0;
+        j->meta->magic = JOURNAL_META_MAGIC;
+    }
+    j->synced_ack = j->meta->ack_seq;
+    return 0;
+}
+
+/*
+ * Walk existing segments to find the last valid record. New records
+ * always go into a fresh segment after the last one found, so a torn
+ * tail left by a crash is never appended to.
+ */
+static int
+journal_recover(message_journal_t *j)
+{
+    char path[JOURNAL_PATH_MAX + 32];
+    const journal_seg_hdr_t *hdr;
+    const journal_rec_t *rec;
+    struct stat st;
+    uint8_t *base;
+    uint64_t seq;
+    uint32_t seg, off;
+    int fd, found = 0;
+
+    j->next_seq = j->meta->ack_seq + 1;
+
+    for (seg = j->meta->first_seg; ; seg++) {
+        journal_seg_path(j, seg, path, sizeof(path));
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            if (errno == ENOENT) {
+                break;
+            }
+            return -1;
+        }
+        if (fstat(fd, &st) || st.st_size < (off_t)JSEG_HDR_SIZE) {
+            close(fd);
+            break;
+        }
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            return -1;
+        }
+
+        hdr = (const journal_seg_hdr_t *)(void *)base;
+        if (hdr->magic != JOURNAL_SEG_MAGIC || hdr->seg != seg) {
+            munmap(base, st.st_size);
+            break;
+        }
+        found = 1;
+        seq = hdr->first_seq;
+        off = JSEG_HDR_SIZE;
+        while (off + sizeof(journal_rec_t) <= (uint64_t)st.st_size) {
+            rec = (const journal_rec_t *)(void *)(base + off);
+            if (!rec->length || rec->seq != seq ||
+                off + JREC_SIZE(rec->length) > (uint64_t)st.st_size ||
+                rec->csum != journal_csum(journal_hash(rec->data,
+                                                       rec->length), seq)) {
+                break;
+            }
+            off += JREC_SIZE(rec->length);
+            seq++;
+        }
+        if (seq > j->next_seq) {
+            j->next_seq = seq;
+        }
+        munmap(base, st.st_size);
+    }
+
+    j->cur_seg = found ? seg : j->meta->first_seg;
+
+    j->replay_fd = -1;
+    j->replay_seg = j->meta->first_seg;
+    j->replay_seq = j->meta->ack_seq + 1;
+    j->replay_end = j->next_seq;
+    return 0;
+}
+
+/*
+ * Create and map a segment file. The header stays invalid until
+ * journal_seg_start, so an unused spare is skipped by recovery.
+ */
+static int
+journal_seg_create(message_journal_t *j, uint32_t seg,
+                   int *fd_out, uint8_t **base_out)
+{
+    char path[JOURNAL_PATH_MAX + 32];
+    journal_seg_hdr_t *hdr;
+    void *addr;
+    int fd;
+
+    journal_seg_path(j, seg, path, sizeof(path));
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, j->seg_size)) {
+        close(fd);
+        return -1;
+    }
+    /*
+     * Populate up front so that appends do not take page faults
+     * on the send path.
+     */
+    addr = mmap(NULL, j->seg_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    hdr = (journal_seg_hdr_t *)addr;
+    hdr->seg = seg;
+
+    *fd_out = fd;
+    *base_out = (uint8_t *)addr;
+    return 0;
+}
+
+static void
+journal_seg_start(uint8_t *base, uint64_t first_seq)
+{
+    journal_seg_hdr_t *hdr = (journal_seg_hdr_t *)(void *)base;
+
+    hdr->first_seq = first_seq;
+    hdr->magic = JOURNAL_SEG_MAGIC;
+}
+
+/*
+ * Create the segment following the current one unless there is one
+ * already. Called with sync_lock held; the current segment cannot
+ * move past a missing spare meanwhile.
+ */
+static int
+journal_spare_prepare(message_journal_t *j)
+{
+    uint8_t *base;
+    uint32_t seg;
+    int fd, ready;
+
+    pthread_mutex_lock(&j->seg_lock);
+    ready = j->spare_base != NULL;
+    seg = j->cur_seg + 1;
+    pthread_mutex_unlock(&j->seg_lock);
+    if (ready) {
+        return 0;
+    }
+
+    if (journal_seg_create(j, seg, &fd, &base)) {
+        return -1;
+    }
+    pthread_mutex_lock(&j->seg_lock);
+    j->spare_fd = fd;
+    j->spare_base = base;
+    pthread_mutex_unlock(&j->seg_lock);
+    return 0;
+}
+
+/*
+ * Wake the flusher up ahead of its interval.
+ */
+static void
+journal_kick(message_journal_t *j)
+{
+    if (j->flusher_running) {
+        pthread_mutex_lock(&j->flush_lock);
+        j->kick = 1;
+        pthread_cond_signal(&j->flush_cond);
+        pthread_mutex_unlock(&j->flush_lock);
+    }
+}
+
+/*
+ * Switch to the spare segment and queue the full one for the flusher.
+ * Called with the queue write lock held. The spare is only created
+ * here when the flusher did not get to it, or there is no flusher.
+ */
+static int
+journal_roll(message_journal_t *j)
+{
+    journal_seg_t *old;
+    int ready, rtn = 0;
+
+    old = (journal_seg_t *)malloc(sizeof(journal_seg_t));
+    if (!old) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&j->seg_lock);
+    ready = j->spare_base != NULL;
+    pthread_mutex_unlock(&j->seg_lock);
+    if (!ready) {
+        pthread_mutex_lock(&j->sync_lock);
+        rtn = journal_spare_prepare(j);
+        pthread_mutex_unlock(&j->sync_lock);
+        if (rtn) {
+            free(old);
+            return -1;
+        }
+    }
+    journal_seg_start(j->spare_base, j->next_seq);
+
+    old->next = NULL;
+    old->seg = j->cur_seg;
+    old->end = j->write_off;
+    old->fd = j->seg_fd;
+    old->base = j->seg_base;
+
+    pthread_mutex_lock(&j->seg_lock);
+    *j->retired_tail = old;
+    j->retired_tail = &old->next;
+    j->seg_fd = j->spare_fd;
+    j->seg_base = j->spare_base;
+    j->cur_seg++;
+    j->spare_fd = -1;
+    j->spare_base = NULL;
+    __atomic_store_n(&j->write_off, JSEG_HDR_SIZE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&j->seg_lock);
+
+    journal_kick(j);
+    return 0;
+}
+
+uint64_t message_journal_hash(const message_header_t *m)
+{
+    return journal_hash((const uint8_t *)m, journal_rec_len(m));
+}
+
+int message_journal_append(message_journal_t *j, message_header_t *m,
+                           uint64_t hash)
+{
+    journal_rec_t *rec;
+    uint32_t len, size;
+
+    len = journal_rec_len(m);
+    size = JREC_SIZE(len);
+    if (size > j->seg_size - JSEG_HDR_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (j->write_off + size > j->seg_size && journal_roll(j)) {
+        return -1;
+    }
+
+    rec = (journal_rec_t *)(void *)(j->seg_base + j->write_off);
+    memcpy(rec->data, m, len);
+    rec->seq = j->next_seq;
+    rec->csum = journal_csum(hash, rec->seq);
+    rec->length = len;
+    j->pending = size;
+
+    return 0;
+}
+
+void message_journal_commit(message_journal_t *j)
+{
+    __atomic_store_n(&j->write_off, j->write_off + j->pending,
+                     __ATOMIC_RELEASE);
+    j->pending = 0;
+    j->next_seq++;
+}
+
+void message_journal_abort(message_journal_t *j)
+{
+    journal_rec_t *rec;
+
+    rec = (journal_rec_t *)(void *)(j->seg_base + j->write_off);
+    rec->length = 0;
+    j->pending = 0;
+}
+
+void message_journal_ack(message_journal_t *j, uint32_t num)
+{
+    __atomic_store_n(&j->meta->ack_seq, j->meta->ack_seq + num,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * Remove leading segments before cur_seg whose records are all
+ * acknowledged. Called with sync_lock held.
+ */
+static void
+journal_reap(message_journal_t *j, uint64_t ack, uint32_t cur_seg)
+{
+    char path[JOURNAL_PATH_MAX + 32];
+    journal_seg_hdr_t hdr;
+    uint32_t seg;
+    int fd, rtn;
+
+    while ((seg = j->meta->first_seg) < cur_seg) {
+        journal_seg_path(j, seg + 1, path, sizeof(path));
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+        rtn = pread(fd, &hdr, sizeof(hdr), 0);
+        close(fd);
+        if (rtn != sizeof(hdr) || hdr.magic != JOURNAL_SEG_MAGIC) {
+            return;
+        }
+        if (hdr.first_seq > ack + 1) {
+            return;
+        }
+
+        /*
+         * Move the start point first. A crash before the unlink
+         * leaves an orphan file, never a hole.
+         */
+        j->meta->first_seg = seg + 1;
+        (void)!journal_sync_range(j, j->meta_fd, j->meta, j->page_size);
+        journal_seg_path(j, seg, path, sizeof(path));
+        unlink(path);
+    }
+}
+
+int message_journal_sync(message_journal_t *j)
+{
+    journal_seg_t *retired, *s;
+    uint32_t seg, end, start;
+    uint8_t *base;
+    uint64_t ack;
+    int fd, rtn = 0;
+
+    pthread_mutex_lock(&j->sync_lock);
+
+    pthread_mutex_lock(&j->seg_lock);
+    retired = j->retired;
+    j->retired = NULL;
+    j->retired_tail = &j->retired;
+    seg = j->cur_seg;
+    fd = j->seg_fd;
+    base = j->seg_base;
+    end = __atomic_load_n(&j->write_off, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&j->seg_lock);
+
+    /*
+     * Full segments first, oldest first. Only this function unmaps
+     * them, so the current segment stays mapped while it is synced
+     * below even if a producer retires it meanwhile.
+     */
+    while ((s = retired)) {
+        start = s->seg == j->synced_seg ?
+                j->synced_off & ~(j->page_size - 1) : 0;
+        if (s->end > start &&
+            journal_sync_range(j, s->fd, s->base + start, s->end - start)) {
+            rtn = -1;
+        }
+        munmap(s->base, j->seg_size);
+        close(s->fd);
+        retired = s->next;
+        free(s);
+    }
+
+    if (seg != j->synced_seg) {
+        j->synced_seg = seg;
+        j->synced_off = 0;
+    }
+    if (end > j->synced_off) {
+        start = j->synced_off & ~(j->page_size - 1);
+        if (journal_sync_range(j, fd, base + start, end - start)) {
+            rtn = -1;
+        } else {
+            j->synced_off = end;
+        }
+    }
+
+    ack = __atomic_load_n(&j->meta->ack_seq, __ATOMIC_RELAXED);
+    if (ack != j->synced_ack) {
+        if (journal_sync_range(j, j->meta_fd, j->meta, j->page_size)) {
+            rtn = -1;
+        } else {
+            j->synced_ack = ack;
+        }
+    }
+    /* Also after a roll, which may complete a fully acked segment. */
+    journal_reap(j, j->synced_ack, seg);
+
+    if (!__atomic_load_n(&j->stop, __ATOMIC_RELAXED) &&
+        journal_spare_prepare(j)) {
+        rtn = -1;
+    }
+
+    pthread_mutex_unlock(&j->sync_lock);
+    return rtn ? -1 : 0;
+}
+
+int message_journal_replay_next(message_journal_t *j, message_header_t **out)
+{
+    char path[JOURNAL_PATH_MAX + 32];
+    message_header_t *m;
+    journal_rec_t rec;
+    struct stat st;
+
+    while (j->replay_seq < j->replay_end) {
+        if (j->replay_fd == -1) {
+            if (j->replay_seg >= j->cur_seg) {
+                break;
+            }
+            journal_seg_path(j, j->replay_seg, path, sizeof(path));
+            j->replay_fd = open(path, O_RDONLY);
+            if (j->replay_fd == -1) {
+                if (errno != ENOENT) {
+                    return -1;
+                }
+                j->replay_seg++;
+                continue;
+            }
+            if (fstat(j->replay_fd, &st)) {
+                return -1;
+            }
+            j->replay_off = JSEG_HDR_SIZE;
+            j->replay_size = st.st_size;
+        }
+
+        if (j->replay_off + sizeof(rec) > j->replay_size ||
+            pread(j->replay_fd, &rec, sizeof(rec), j->replay_off)
+                                            != sizeof(rec) ||
+            !rec.length ||
+            j->replay_off + JREC_SIZE(rec.length) > j->replay_size) {
+            goto next_seg;
+        }
+        if (rec.seq < j->replay_seq) {
+            j->replay_off += JREC_SIZE(rec.length);
+            continue;
+        }
+
+        m = message_new(0, 0, rec.length);
+        if (!m) {
+            return -1;
+        }
+        if (pread(j->replay_fd, m, rec.length,
+                  j->replay_off + sizeof(rec)) != rec.length ||
+            rec.csum != journal_csum(journal_hash((uint8_t *)m, rec.length),
+                                     rec.seq)) {
+            m->magic = MSG_MAGIC;
+            message_free(m);
+            goto next_seg;
+        }
+        m->magic = MSG_MAGIC;
+
+        j->replay_off += JREC_SIZE(rec.length);
+        j->replay_seq = rec.seq + 1;
+        *out = m;
+        return 1;
+
+next_seg:
+        close(j->replay_fd);
+        j->replay_fd = -1;
+        j->replay_seg++;
+    }
+
+    if (j->replay_fd != -1) {
+        close(j->replay_fd);
+        j->replay_fd = -1;
+    }
+    j->replay_seq = j->replay_end;
+    return 0;
+}
+
+static void *
+journal_flusher(void *arg)
+{
+    message_journal_t *j = (message_journal_t *)arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&j->flush_lock);
+    while (!j->stop) {
+        if (!j->kick) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += j->flush_ms / 1000;
+            ts.tv_nsec += (long)(j->flush_ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&j->flush_cond, &j->flush_lock, &ts);
+        }
+        if (j->stop) {
+            break;
+        }
+        j->kick = 0;
+        pthread_mutex_unlock(&j->flush_lock);
+        (void)message_journal_sync(j);
+        pthread_mutex_lock(&j->flush_lock);
+    }
+    pthread_mutex_unlock(&j->flush_lock);
+
+    return NULL;
+}
+
+static void
+journal_release(message_journal_t *j)
+{
+    char path[JOURNAL_PATH_MAX + 32];
+    journal_seg_t *s;
+
+    while ((s = j->retired)) {
+        munmap(s->base, j->seg_size);
+        close(s->fd);
+        j->retired = s->next;
+        free(s);
+    }
+    if (j->spare_base) {
+        munmap(j->spare_base, j->seg_size);
+        close(j->spare_fd);
+        journal_seg_path(j, j->cur_seg + 1, path, sizeof(path));
+        unlink(path);
+    }
+    if (j->seg_base) {
+        munmap(j->seg_base, j->seg_size);
+    }
+    if (j->seg_fd != -1) {
+        close(j->seg_fd);
+    }
+    if (j->replay_fd != -1) {
+        close(j->replay_fd);
+    }
+    if (j->meta) {
+        munmap(j->meta, j->page_size);
+    }
+    if (j->meta_fd != -1) {
+        close(j->meta_fd);
+    }
+    free(j);
+}
+
+message_journal_t *
+message_journal_open(int que_id, const message_journal_config_t *cfg)
+{
+    message_journal_t *j;
+    pthread_condattr_t attr;
+
+    if (!cfg || !cfg->dir || strlen(cfg->dir) >= JOURNAL_PATH_MAX) {
+        return NULL;
+    }
+
+    j = (message_journal_t *)calloc(1, sizeof(message_journal_t));
+    if (!j) {
+        return NULL;
+    }
+    j->meta_fd = j->seg_fd = j->spare_fd = j->replay_fd = -1;
+    j->retired_tail = &j->retired;
+    j->que_id = que_id;
+    j->sync_mode = cfg->sync_mode;
+    j->flush_ms = cfg->flush_interval_ms;
+    j->page_size = sysconf(_SC_PAGESIZE);
+    j->seg_size = cfg->segment_size ? cfg->segment_size
+                                    : JOURNAL_DEF_SEG_SIZE;
+    j->seg_size = (j->seg_size + j->page_size - 1) & ~(j->page_size - 1);
+    strcpy(j->dir, cfg->dir);
+
+    if (mkdir(j->dir, 0755) && errno != EEXIST) {
+        goto open_err;
+    }
+    (void)!pthread_mutex_init(&j->seg_lock, NULL);
+    (void)!pthread_mutex_init(&j->sync_lock, NULL);
+    (void)!pthread_mutex_init(&j->flush_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    (void)!pthread_cond_init(&j->flush_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (journal_meta_open(j) || journal_recover(j)) {
+        goto open_err;
+    }
+    if (journal_seg_create(j, j->cur_seg, &j->seg_fd, &j->seg_base)) {
+        j->seg_base = NULL;
+        goto open_err;
+    }
+    journal_seg_start(j->seg_base, j->next_seq);
+    j->write_off = JSEG_HDR_SIZE;
+    j->synced_seg = j->cur_seg;
+    if (journal_spare_prepare(j)) {
+        goto open_err;
+    }
+
+    if (j->flush_ms) {
+        if (pthread_create(&j->flusher, NULL, journal_flusher, j)) {
+            goto open_err;
+        }
+        j->flusher_running = 1;
+    }
+
+    return j;
+
+open_err:
+    journal_release(j);
+    return NULL;
+}
+
+void message_journal_close(message_journal_t *j)
+{
+    pthread_mutex_lock(&j->flush_lock);
+    __atomic_store_n(&j->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&j->flush_cond);
+    pthread_mutex_unlock(&j->flush_lock);
+    if (j->flusher_running) {
+        pthread_join(j->flusher, NULL);
+    }
+    (void)message_journal_sync(j);
+
+    pthread_cond_destroy(&j->flush_cond);
+    pthread_mutex_destroy(&j->flush_lock);
+    pthread_mutex_destroy(&j->sync_lock);
+    pthread_mutex_destroy(&j->seg_lock);
+    journal_release(j);
+}
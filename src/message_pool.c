@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2024  sh4run
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Message memory pool.
+ *
+ * Chunks are carved from large slabs mapped with hugepages when the
+ * system has them reserved, or from regular mappings advised for
+ * transparent hugepages otherwise. A slab is only carved as chunks are
+ * needed, so untouched slab memory is never faulted in. Freed chunks
+ * go to a free list and are reused first.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "message_pool.h"
+
+#define POOL_HUGEPAGE_SIZE   (2UL << 20)
+#define POOL_CHUNK_ALIGN     16
+
+typedef struct _pool_slab_t {
+    struct _pool_slab_t  *next;
+    size_t               size;
+} pool_slab_t;
+
+#define POOL_SLAB_HDR_SIZE \
+    ((sizeof(pool_slab_t) + POOL_CHUNK_ALIGN - 1) & ~(POOL_CHUNK_ALIGN - 1))
+
+typedef struct _pool_chunk_t {
+    struct _pool_chunk_t *next;
+} pool_chunk_t;
+
+/**
+ * Structure which holds a message pool.
+ */
+struct _message_pool_t {
+    pthread_mutex_t  lock;
+    uint32_t         chunk_size;
+    uint32_t         grow_count;
+    uint32_t         max_count;
+    pool_chunk_t     *free_list;
+    /* Uncarved part of the newest slab. */
+    uint8_t          *carve_ptr;
+    uint8_t          *carve_end;
+    pool_slab_t      *slabs;
+    uint64_t         slab_num;
+    uint64_t         total;
+    uint64_t         in_use;
+    uint64_t         high_water;
+};
+
+/*
+ * Map a new slab able to hold up to 'count' chunks. With 'exact' the
+ * slab holds 'count' chunks only; otherwise it also keeps the chunks
+ * the hugepage rounding left room for. Called with the pool lock held.
+ */
+static int
+pool_grow(message_pool_t *pool, uint32_t count, int exact)
+{
+    pool_slab_t *slab;
+    size_t size;
+    uint64_t chunks;
+    void *addr;
+
+    if (pool->max_count) {
+        if (pool->total >= pool->max_count) {
+            return -1;
+        }
+        if (count > pool->max_count - pool->total) {
+            count = pool->max_count - pool->total;
+        }
+    }
+    if (!count) {
+        return -1;
+    }
+
+    size = POOL_SLAB_HDR_SIZE + (size_t)count * pool->chunk_size;
+    size = (size + POOL_HUGEPAGE_SIZE - 1) & ~(POOL_HUGEPAGE_SIZE - 1);
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr == MAP_FAILED) {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return -1;
+        }
+        (void)madvise(addr, size, MADV_HUGEPAGE);
+    }
+
+    /*
+     * Keep whatever the rounding left over, up to the pool maximum.
+     */
+    chunks = exact ? count : (size - POOL_SLAB_HDR_SIZE) / pool->chunk_size;
+    if (pool->max_count && chunks > pool->max_count - pool->total) {
+        chunks = pool->max_count - pool->total;
+    }
+
+    slab = (pool_slab_t *)addr;
+    slab->size = size;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_num++;
+
+    pool->carve_ptr = (uint8_t *)addr + POOL_SLAB_HDR_SIZE;
+    pool->carve_end = pool->carve_ptr + chunks * pool->chunk_size;
+    pool->total += chunks;
+
+    return 0;
+}
+
+message_pool_t *
+message_pool_new(uint32_t chunk_size, const message_pool_config_t *cfg)
+{
+    message_pool_t *pool;
+
+    pool = (message_pool_t *)calloc(1, sizeof(message_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    if (chunk_size < sizeof(pool_chunk_t)) {
+        chunk_size = sizeof(pool_chunk_t);
+    }
+    pool->chunk_size = (chunk_size + POOL_CHUNK_ALIGN - 1)
+                                    & ~(POOL_CHUNK_ALIGN - 1);
+    pool->grow_count = cfg->grow_count;
+    pool->max_count = cfg->max_count;
+
+    if (pthread_mutex_init(&pool->lock, NULL)) {
+        free(pool);
+        return NULL;
+    }
+
+    if (cfg->initial_count && pool_grow(pool, cfg->initial_count, 1)) {
+        message_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void message_pool_destroy(message_pool_t *pool)
+{
+    pool_slab_t *slab;
+
+    while ((slab = pool->slabs)) {
+        pool->slabs = slab->next;
+        munmap(slab, slab->size);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void *message_pool_alloc(message_pool_t *pool)
+{
+    pool_chunk_t *chunk;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((chunk = pool->free_list)) {
+        pool->free_list = chunk->next;
+    } else {
+        if (pool->carve_ptr == pool->carve_end &&
+            (!pool->grow_count || pool_grow(pool, pool->grow_count, 0))) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        chunk = (pool_chunk_t *)(void *)pool->carve_ptr;
+        pool->carve_ptr += pool->chunk_size;
+    }
+    if (++pool->in_use > pool->high_water) {
+        pool->high_water = pool->in_use;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return chunk;
+}
+
+void message_pool_free(message_pool_t *pool, void *ptr)
+{
+    pool_chunk_t *chunk = (pool_chunk_t *)ptr;
+
+    pthread_mutex_lock(&pool->lock);
+    chunk->next = pool->free_list;
+    pool->free_list = chunk;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void message_pool_get_stats(message_pool_t *pool, message_pool_stats_t *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    stats->total = pool->total;
+    stats->in_use = pool->in_use;
+    stats->free = pool->total - pool->in_use;
+    stats->high_water = pool->high_water;
+    stats->slabs = pool->slab_num;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2024  sh4run
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Handler profiling.
+ *
+ * message_recv counts handler calls per message type and times one
+ * call out of sample_rate with the CPU cycle counter. Unsampled calls
+ * cost one counter update. The dump deadline is checked once per
+ * message_recv call, not per message.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "message_queue.h"
+#include "message_prof.h"
+
+static uint64_t
+message_prof_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t message_prof_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+message_prof_t *message_prof_new(const message_prof_config_t *cfg)
+{
+    message_prof_t *prof;
+
+    if (!cfg || (cfg->dump_interval_ms && !cfg->dump_cb)) {
+        return NULL;
+    }
+    prof = (message_prof_t *)calloc(1, sizeof(message_prof_t));
+    if (!prof) {
+        return NULL;
+    }
+    prof->cfg = *cfg;
+    if (!prof->cfg.sample_rate) {
+        prof->cfg.sample_rate = 1;
+    }
+    prof->countdown = prof->cfg.sample_rate;
+    if (prof->cfg.dump_interval_ms) {
+        prof->next_dump_ms = message_prof_now_ms() +
+                             prof->cfg.dump_interval_ms;
+    }
+    return prof;
+}
+
+void message_prof_free(message_prof_t *prof)
+{
+    free(prof);
+}
+
+void message_prof_sample(msgq_prof_type_t *t, uint64_t cycles)
+{
+    uint32_t bucket;
+
+    bucket = cycles ? 64 - __builtin_clzll(cycles) : 0;
+    if (bucket >= MSG_PROF_HIST_BUCKETS) {
+        bucket = MSG_PROF_HIST_BUCKETS - 1;
+    }
+    message_prof_add(&t->samples, 1);
+    message_prof_add(&t->total_cycles, cycles);
+    message_prof_add(&t->hist[bucket], 1);
+    if (cycles > t->max_cycles) {
+        __atomic_store_n(&t->max_cycles, cycles, __ATOMIC_RELAXED);
+    }
+}
+
+void message_prof_tick(message_prof_t *prof, message_queue_t *que)
+{
+    uint64_t now;
+    int num;
+
+    if (!prof->cfg.dump_interval_ms) {
+        return;
+    }
+    now = message_prof_now_ms();
+    if (now >= prof->next_dump_ms) {
+        prof->next_dump_ms = now + prof->cfg.dump_interval_ms;
+        num = message_prof_snapshot(prof, prof->dump,
+                                    MSG_PROF_MAX_TYPES + 1);
+        prof->cfg.dump_cb(que, prof->dump, num, prof->cfg.dump_arg);
+    }
+}
+
+int message_prof_snapshot(message_prof_t *prof,
+                          message_prof_entry_t *entries, int max)
+{
+    msgq_prof_type_t *t;
+    message_prof_entry_t *e;
+    int i, b, num = 0;
+
+    for (i = 0; i <= MSG_PROF_MAX_TYPES && num < max; i++) {
+        t = &prof->types[i];
+        if (!__atomic_load_n(&t->calls, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        e = &entries[num++];
+        e->message_type = i < MSG_PROF_MAX_TYPES ? i : MSG_PROF_TYPE_OTHER;
+        e->calls = __atomic_load_n(&t->calls, __ATOMIC_RELAXED);
+        e->samples = __atomic_load_n(&t->samples, __ATOMIC_RELAXED);
+        e->total_cycles = __atomic_load_n(&t->total_cycles,
+                                          __ATOMIC_RELAXED);
+        e->max_cycles = __atomic_load_n(&t->max_cycles, __ATOMIC_RELAXED);
+        for (b = 0; b < MSG_PROF_HIST_BUCKETS; b++) {
+            e->hist[b] = __atomic_load_n(&t->hist[b], __ATOMIC_RELAXED);
+        }
+    }
+    return num;
+}
@@ -27,19 +27,55 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "message_queue.h"
-#include "mem_pool.h"
+#include "spsc_ring.h"
+#include "message_journal.h"
+#include "message_pool.h"
+#include "message_buf.h"
+#include "message_prof.h"
+
 
+#define MSG_POOL_INIT_COUNT   256
+#define MSG_POOL_GROW_COUNT   4096
+#define MSG_POOL_MAX_COUNT    (1 << 20)
 
-#define MEM_POOL_COUNT   256
+/**
+ * Structure which holds the sub-rings of a fan-in queue.
+ * Each registered producer thread owns one SPSC sub-ring. A bit in
+ * 'ready' is set when the sub-ring turns non-empty, so the consumer
+ * only visits sub-rings with work.
+ *
+ * The consumer marks a sub-ring 'parked' when it leaves it empty. A
+ * producer takes the mark back after each enqueue, and only touches
+ * the shared bitmap when it found the ring parked. Both sides use an
+ * exchange on 'parked', so either the producer finds the mark, or the
+ * consumer sees the new message when it re-checks after parking.
+ */
+typedef struct _msgq_fanin_t {
+    uint32_t             max_producers;
+    uint32_t             ready_words;
+    uint32_t             gen;
+    uint32_t             next_word;
+    uint64_t             *ready;
+    uint8_t              *owned;
+    spsc_ring_t          **rings;
+} msgq_fanin_t;
 
 /**
  * Structure which holds a message queue.
@@ -51,25 +87,109 @@ typedef struct _message_queue_t {
     void *               cb_arg;
     ring_buffer_t        *message_ring;
     pthread_mutex_t      write_lock;
+    message_journal_t    *journal;
+    msgq_fanin_t         *fanin;
+    /* Flow control. Enabled when wm_high is not 0. */
+    uint32_t             wm_high;
+    uint32_t             wm_low;
+    int32_t              throttled;
+    int32_t              wm_fd;
+    msg_wm_cb_func_t     wm_cb;
+    void *               wm_arg;
+    /* Serializes transition reports; 'wm_sent' is the last one. */
+    pthread_mutex_t      wm_lock;
+    int32_t              wm_sent;
+    /*
+     * Futex backend. 'futex' is bumped on each notification; the
+     * consumer sleeps on it while 'waiters' is set.
+     */
+    uint32_t             futex;
+    uint32_t             waiters;
+    /* Handler profiling. NULL when disabled. */
+    message_prof_t       *prof;
 } message_queue_t;
 
 #define MSGQ_ID(que)    ((que)->queue_id)
 #define MSGQ_FD(que)    ((que)->fd)
 #define MSGQ_WLOCK(que) (&((que)->write_lock))
+#define MSGQ_IN_USE(que) ((que)->message_ring || (que)->fanin)
+#define MSGQ_FUTEX(que) ((que)->send_cb_funcptr == MSG_NOTIF_FUTEX)
+
+/*
+ * Per-thread fan-in registration, indexed by queue id. 'gen' ties a
+ * slot to one incarnation of the queue.
+ */
+typedef struct _msgq_tls_slot_t {
+    uint32_t             gen;
+    int32_t              slot;
+} msgq_tls_slot_t;
 
 static int max_queue_num;
 static message_queue_t *msg_queues;
-static FixedMemPool *msg_pool;
+static message_pool_t *msg_pool;
 static int mem_size;
+/*
+ * Offset of the buffer list pointer in a message chunk, and the number
+ * of list entries kept in the chunk after it.
+ */
+static int sg_offset;
+static uint32_t sg_inline;
 static pthread_mutex_t q_table_lock;
+static pthread_key_t tls_key;
+static __thread msgq_tls_slot_t *tls_slots;
 
 int message_queue_get_fd(message_queue_t *que)
 {
     return MSGQ_FD(que);
 }
 
+int message_queue_is_futex(message_queue_t *que)
+{
+    return MSGQ_FUTEX(que);
+}
+
+/*
+ * Release the fan-in slots of an exiting producer thread so that
+ * other threads can take them over.
+ */
+static void
+fanin_thread_exit(void *arg)
+{
+    msgq_tls_slot_t *slots = (msgq_tls_slot_t *)arg;
+    msgq_fanin_t *fanin;
+    int i;
+
+    /* Keeps message_queue_free from freeing a fan-in meanwhile. */
+    pthread_mutex_lock(&q_table_lock);
+    for (i = 0; i < max_queue_num; i++) {
+        fanin = msg_queues[i].fanin;
+        if (slots[i].gen && fanin && fanin->gen == slots[i].gen) {
+            __atomic_store_n(&fanin->owned[slots[i].slot], 0,
+                             __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&q_table_lock);
+    free(slots);
+}
+
 int message_queue_init(int que_num, int msg_size)
 {
+    message_pool_config_t cfg = {
+        .initial_count = MSG_POOL_INIT_COUNT,
+        .grow_count    = MSG_POOL_GROW_COUNT,
+        .max_count     = MSG_POOL_MAX_COUNT,
+    };
+
+    return message_queue_init_ex(que_num, msg_size, &cfg);
+}
+
+int message_queue_init_ex(int que_num, int msg_size,
+                          const message_pool_config_t *pool_cfg)
+{
+    if (!pool_cfg || msg_size < (int)sizeof(message_header_t)) {
+        return -1;
+    }
+
     max_queue_num = que_num;
     msg_queues = (message_queue_t*)malloc(sizeof(message_queue_t) * que_num);
     if (!msg_queues) {
@@ -77,12 +197,17 @@ int message_queue_init(int que_num, int msg_size)
     }
     memset(msg_queues, 0, sizeof(message_queue_t) * que_num);
 
-    if (pool_fixed_init(&msg_pool, msg_size, MEM_POOL_COUNT) 
-                                            != MEM_POOL_ERR_OK) {
+    sg_offset = (msg_size + 7) & ~7;
+    sg_inline = pool_cfg->sg_inline;
+    msg_pool = message_pool_new(sg_offset + sizeof(message_sg_t *) +
+                                (sg_inline ? MSG_SG_SIZE(sg_inline) : 0),
+                                pool_cfg);
+    if (!msg_pool) {
         goto init_err;
     }
 
     (void)!pthread_mutex_init(&q_table_lock, NULL);
+    (void)!pthread_key_create(&tls_key, fanin_thread_exit);
 
     mem_size = msg_size;
 
@@ -91,75 +216,219 @@ int message_queue_init(int que_num, int msg_size)
 init_err:
     if (msg_queues) {
         free(msg_queues);
+        msg_queues = NULL;
     }
     return -1;
 }
 
+int message_queue_pool_stats(message_pool_stats_t *stats)
+{
+    if (!msg_pool || !stats) {
+        return -1;
+    }
+    message_pool_get_stats(msg_pool, stats);
+    return 0;
+}
+
+/*
+ * Set up message notification of a new queue: the embedded eventfd
+ * when no callback is given, the futex, or the external callback.
+ */
+static int
+message_queue_notif_init(message_queue_t *que,
+                         msg_notif_cb_func_t cb, void *arg)
+{
+    if (!cb) {
+        que->fd = eventfd(0, EFD_NONBLOCK);
+        if (que->fd == -1) {
+            return -1;
+        }
+        que->send_cb_funcptr = NULL;
+        que->cb_arg = NULL;
+    } else {
+        que->fd = -1;
+        que->send_cb_funcptr = cb;
+        que->cb_arg = arg;
+    }
+    que->futex = 0;
+    que->waiters = 0;
+    return 0;
+}
+
 message_queue_t *
 message_queue_new(int que_id, uint32_t que_size,
                   msg_notif_cb_func_t cb, void *arg)
 {
-    message_queue_t *que = NULL;
+    message_queue_t *que;
 
-    if (que_id < max_queue_num) {
-        que = &msg_queues[que_id];
-        pthread_mutex_lock(&q_table_lock);
-        if (!que->message_ring) {
-            que->queue_id = que_id;
-            que->message_ring = ring_buffer_new(que_size * sizeof(void*));
-            if (!que->message_ring) {
-                goto que_new_err;
-            } else {
-                if (!cb) {
-                    que->fd = eventfd(0, EFD_NONBLOCK);
-                    if (que->fd == -1) {
-                        goto que_new_err;
-                    } else {
-                        if (pthread_mutex_init(&que->write_lock, NULL)) {
-                            goto que_new_err;
-                        }
-                    }
-                } else {
-                    que->fd = -1;
-                    que->send_cb_funcptr = cb;
-                    que->cb_arg = arg;
-                }
-            }
-        } else {
-            /*
-             * Queue allocated.
-             */
-            pthread_mutex_unlock(&q_table_lock);
-            return NULL;
-        }
+    if (que_id < 0 || que_id >= max_queue_num) {
+        return NULL;
+    }
+
+    que = &msg_queues[que_id];
+    pthread_mutex_lock(&q_table_lock);
+    if (MSGQ_IN_USE(que)) {
+        /*
+         * Queue allocated.
+         */
+        pthread_mutex_unlock(&q_table_lock);
+        return NULL;
+    }
+
+    que->queue_id = que_id;
+    que->fd = -1;
+    que->message_ring = ring_buffer_new(que_size * sizeof(void*));
+    if (!que->message_ring ||
+        message_queue_notif_init(que, cb, arg) ||
+        pthread_mutex_init(&que->write_lock, NULL)) {
+        goto que_new_err;
     }
 
     pthread_mutex_unlock(&q_table_lock);
     return que;
 
 que_new_err:
-    if (que) {
-        pthread_mutex_unlock(&q_table_lock);
-        if (que->fd != -1) {
-            close(que->fd);
+    if (que->fd != -1) {
+        close(que->fd);
+        que->fd = -1;
+    }
+    if (que->message_ring) {
+        ring_buffer_free(que->message_ring);
+        que->message_ring = NULL;
+    }
+    pthread_mutex_unlock(&q_table_lock);
+    return NULL;
+}
+
+static void
+fanin_free(msgq_fanin_t *fanin)
+{
+    uint32_t i;
+
+    if (fanin->rings) {
+        for (i = 0; i < fanin->max_producers; i++) {
+            if (fanin->rings[i]) {
+                spsc_ring_free(fanin->rings[i]);
+            }
         }
-        if (que->message_ring) {
-            ring_buffer_free(que->message_ring);
-            que->message_ring = NULL;
+        free(fanin->rings);
+    }
+    free(fanin->owned);
+    free(fanin->ready);
+    free(fanin);
+}
+
+static msgq_fanin_t *
+fanin_new(uint32_t ring_size, uint32_t max_producers)
+{
+    static uint32_t fanin_gen;
+    msgq_fanin_t *fanin;
+    uint32_t i;
+
+    fanin = (msgq_fanin_t *)calloc(1, sizeof(msgq_fanin_t));
+    if (!fanin) {
+        return NULL;
+    }
+    fanin->max_producers = max_producers;
+    fanin->ready_words = (max_producers + 63) / 64;
+    fanin->gen = __atomic_add_fetch(&fanin_gen, 1, __ATOMIC_RELAXED);
+    fanin->ready = (uint64_t *)aligned_alloc(SPSC_CACHE_LINE,
+                      ((fanin->ready_words * sizeof(uint64_t)
+                        + SPSC_CACHE_LINE - 1) & ~(SPSC_CACHE_LINE - 1)));
+    fanin->owned = (uint8_t *)calloc(max_producers, sizeof(uint8_t));
+    fanin->rings = (spsc_ring_t **)calloc(max_producers,
+                                          sizeof(spsc_ring_t *));
+    if (!fanin->ready || !fanin->owned || !fanin->rings) {
+        goto fanin_err;
+    }
+    memset(fanin->ready, 0, fanin->ready_words * sizeof(uint64_t));
+    for (i = 0; i < max_producers; i++) {
+        fanin->rings[i] = spsc_ring_new(ring_size);
+        if (!fanin->rings[i]) {
+            goto fanin_err;
         }
+        fanin->rings[i]->parked = 1;
+    }
+    return fanin;
+
+fanin_err:
+    fanin_free(fanin);
+    return NULL;
+}
+
+message_queue_t *
+message_queue_new_fanin(int que_id, uint32_t ring_size,
+                        uint32_t max_producers,
+                        msg_notif_cb_func_t cb, void *arg)
+{
+    message_queue_t *que;
+
+    if (que_id < 0 || que_id >= max_queue_num || !max_producers) {
+        return NULL;
     }
+
+    que = &msg_queues[que_id];
+    pthread_mutex_lock(&q_table_lock);
+    if (MSGQ_IN_USE(que)) {
+        pthread_mutex_unlock(&q_table_lock);
+        return NULL;
+    }
+
+    que->queue_id = que_id;
+    que->fd = -1;
+    que->fanin = fanin_new(ring_size, max_producers);
+    if (!que->fanin || message_queue_notif_init(que, cb, arg)) {
+        goto que_new_err;
+    }
+
+    pthread_mutex_unlock(&q_table_lock);
+    return que;
+
+que_new_err:
+    if (que->fanin) {
+        fanin_free(que->fanin);
+        que->fanin = NULL;
+    }
+    pthread_mutex_unlock(&q_table_lock);
     return NULL;
 }
 
 int message_queue_free(message_queue_t *que)
 {
-    if (que && que->message_ring) {
-        ring_buffer_free(que->message_ring);
-        que->message_ring = NULL;
-        pthread_mutex_destroy(&que->write_lock);
+    if (que && MSGQ_IN_USE(que)) {
+        if (que->journal) {
+            message_journal_close(que->journal);
+            que->journal = NULL;
+        }
+        if (que->prof) {
+            message_prof_free(que->prof);
+            que->prof = NULL;
+        }
+        if (que->fanin) {
+            pthread_mutex_lock(&q_table_lock);
+            fanin_free(que->fanin);
+            que->fanin = NULL;
+            pthread_mutex_unlock(&q_table_lock);
+        } else {
+            ring_buffer_free(que->message_ring);
+            que->message_ring = NULL;
+            pthread_mutex_destroy(&que->write_lock);
+        }
         if (que->fd != -1) {
             close(que->fd);
         }
+        que->send_cb_funcptr = NULL;
+        que->cb_arg = NULL;
+        if (que->wm_high) {
+            if (que->wm_fd != -1) {
+                close(que->wm_fd);
+            }
+            pthread_mutex_destroy(&que->wm_lock);
+        }
+        que->wm_high = que->wm_low = 0;
+        que->throttled = 0;
+        que->wm_cb = NULL;
+        que->wm_arg = NULL;
     } else {
         assert(0);
     }
@@ -169,13 +438,12 @@ int message_queue_free(message_queue_t *que)
 message_header_t *message_new(int src_id, int message_type, int length)
 {
     message_header_t *msg;
-    MemPoolError rtn;
 
     if (length > mem_size) {
         return NULL;
     }
-    rtn = pool_fixed_alloc(msg_pool, (void**)&msg);
-    if (rtn != MEM_POOL_ERR_OK) {
+    msg = (message_header_t *)message_pool_alloc(msg_pool);
+    if (!msg) {
         return NULL;
     }
 
@@ -183,6 +451,7 @@ message_header_t *message_new(int src_id, int message_type, int length)
     msg->src_id = src_id;
     msg->message_type = message_type;
     msg->message_length = length;
+    *message_sg_slot(msg) = NULL;
 
     return msg;
 }
@@ -191,20 +460,229 @@ void message_free(message_header_t *message)
 {
     VALIDATE_MSG(message);
 
+    if (*message_sg_slot(message)) {
+        message_sg_free(message);
+        *message_sg_slot(message) = NULL;
+    }
     message->magic = 0;
-    pool_fixed_free(msg_pool, message);
+    message_pool_free(msg_pool, message);
+}
+
+message_sg_t **message_sg_slot(message_header_t *message)
+{
+    return (message_sg_t **)(void *)((uint8_t *)message + sg_offset);
+}
+
+message_sg_t *message_sg_inline(message_header_t *message, uint32_t *size)
+{
+    *size = sg_inline;
+    if (!sg_inline) {
+        return NULL;
+    }
+    return (message_sg_t *)(void *)(message_sg_slot(message) + 1);
+}
+
+static void
+message_queue_notify(message_queue_t *que, uint64_t num)
+{
+    if (MSGQ_FD(que) != -1) {
+        (void)!write(MSGQ_FD(que), &num, sizeof(num));
+    } else if (MSGQ_FUTEX(que)) {
+        /*
+         * Pairs with message_recv_wait: either the consumer sees the
+         * new value, or it is counted in 'waiters' and gets woken.
+         */
+        __atomic_fetch_add(&que->futex, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&que->waiters, __ATOMIC_SEQ_CST)) {
+            (void)syscall(SYS_futex, &que->futex, FUTEX_WAKE_PRIVATE, 1,
+                          NULL, NULL, 0);
+        }
+    } else {
+        que->send_cb_funcptr(que, que->cb_arg);
+    }
+}
+
+/*
+ * Report a flow control transition, through the callback if there is
+ * one, or through the watermark eventfd. Called after each change of
+ * 'throttled'. The state is re-read under wm_lock, so reports racing
+ * between a producer and the consumer cannot arrive out of order; the
+ * last one always matches the current state.
+ */
+static void
+message_queue_wm_notify(message_queue_t *que)
+{
+    uint64_t num = 1;
+    int32_t throttled;
+
+    pthread_mutex_lock(&que->wm_lock);
+    throttled = __atomic_load_n(&que->throttled, __ATOMIC_ACQUIRE);
+    if (throttled != que->wm_sent) {
+        que->wm_sent = throttled;
+        if (que->wm_cb) {
+            que->wm_cb(que, throttled, que->wm_arg);
+        } else {
+            (void)!write(que->wm_fd, &num, sizeof(num));
+        }
+    }
+    pthread_mutex_unlock(&que->wm_lock);
+}
+
+/*
+ * Resume producers once the depth is below the low watermark.
+ * Called by the consumer.
+ */
+static inline void
+message_queue_check_resume(message_queue_t *que)
+{
+    int32_t expected = 1;
+
+    if (__atomic_load_n(&que->throttled, __ATOMIC_ACQUIRE) &&
+        ring_buffer_num_items(que->message_ring) < que->wm_low &&
+        __atomic_compare_exchange_n(&que->throttled, &expected, 0, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        message_queue_wm_notify(que);
+    }
+}
+
+/*
+ * Called by the consumer for each message taken from the ring.
+ */
+static inline void
+message_queue_delivered(message_queue_t *que)
+{
+    if (que->journal) {
+        message_journal_ack(que->journal, 1);
+    }
+    message_queue_check_resume(que);
+}
+
+/*
+ * Hand a message to the receive callback, through the profiler when
+ * enabled.
+ */
+static inline void
+message_queue_handle(message_queue_t *que, msg_handler_cb_func_t rcv_cb,
+                     message_header_t *m, void *arg)
+{
+    if (que->prof) {
+        message_prof_call(que->prof, que, rcv_cb, m, arg);
+    } else {
+        rcv_cb(que, m, arg);
+    }
+}
+
+/*
+ * Claim a sub-ring of a fan-in queue for the calling thread.
+ */
+static int
+fanin_register(message_queue_t *que)
+{
+    msgq_fanin_t *fanin = que->fanin;
+    msgq_tls_slot_t *slot;
+    uint8_t expected;
+    uint32_t i;
+
+    if (!tls_slots) {
+        tls_slots = (msgq_tls_slot_t *)calloc(max_queue_num,
+                                              sizeof(msgq_tls_slot_t));
+        if (!tls_slots) {
+            return -1;
+        }
+        (void)!pthread_setspecific(tls_key, tls_slots);
+    }
+
+    slot = &tls_slots[MSGQ_ID(que)];
+    if (slot->gen == fanin->gen) {
+        return slot->slot;
+    }
+
+    for (i = 0; i < fanin->max_producers; i++) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&fanin->owned[i], &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            slot->gen = fanin->gen;
+            slot->slot = i;
+            return i;
+        }
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+static inline int
+fanin_slot(message_queue_t *que)
+{
+    if (tls_slots && tls_slots[MSGQ_ID(que)].gen == que->fanin->gen) {
+        return tls_slots[MSGQ_ID(que)].slot;
+    }
+    return fanin_register(que);
+}
+
+int message_queue_register_producer(int que_id)
+{
+    message_queue_t *que;
+
+    if (que_id < 0 || que_id >= max_queue_num) {
+        return -1;
+    }
+    que = &msg_queues[que_id];
+    if (!que->fanin) {
+        return -1;
+    }
+    return fanin_slot(que) < 0 ? -1 : 0;
+}
+
+/*
+ * Send through the caller's own sub-ring. The shared ready bitmap is
+ * only written when the sub-ring turns non-empty, and only then is
+ * the consumer notified.
+ */
+static int
+message_send_fanin(message_queue_t *que, message_header_t *message)
+{
+    msgq_fanin_t *fanin = que->fanin;
+    uint64_t *word, bit;
+    spsc_ring_t *ring;
+    int slot;
+
+    slot = fanin_slot(que);
+    if (slot < 0) {
+        return -1;
+    }
+    ring = fanin->rings[slot];
+    if (spsc_ring_enq(ring, (void*)message)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /*
+     * The exchange is on this producer's own cache line. Only a ring
+     * the consumer has parked is flagged in the shared bitmap.
+     */
+    if (!__atomic_exchange_n(&ring->parked, 0, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+    word = &fanin->ready[slot >> 6];
+    bit = 1ULL << (slot & 63);
+    if (!(__atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST) & bit)) {
+        message_queue_notify(que, 1);
+    }
+    return 0;
 }
 
 /**
  * Send a message.
  * Return:
  *     0 : Success
- *    -1 : Destination queue is full.
+ *    -1 : Failure; errno is EAGAIN when the destination queue is full.
  */
 int message_send(message_header_t *message, int dest_id)
 {
     message_queue_t *que;
-    int rtn;
+    uint64_t hash = 0;
+    int rtn, throttle = 0;
     
     VALIDATE_MSG(message);
 
@@ -212,46 +690,468 @@ int message_send(message_header_t *message, int dest_id)
 
     que = &msg_queues[dest_id];
 
+    if (que->fanin) {
+        return message_send_fanin(que, message);
+    }
+    /* Refuse rather than lose the payload on replay. */
+    if (que->journal && MSG_HAS_BUFS(message)) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Hash outside the lock; only the copy is serialized. */
+    if (que->journal) {
+        hash = message_journal_hash(message);
+    }
+
     /*
      * Use a write protection in case of multiple producers.
      */
     pthread_mutex_lock(MSGQ_WLOCK(que));
-    rtn = ring_buffer_enq(que->message_ring, (void*)message);
+    if (que->journal) {
+        /*
+         * Log first so that a record exists for everything in the
+         * ring. The record is dropped if the ring turns out full.
+         */
+        rtn = message_journal_append(que->journal, message, hash);
+        if (!rtn) {
+            rtn = ring_buffer_enq(que->message_ring, (void*)message);
+            if (!rtn) {
+                message_journal_commit(que->journal);
+            } else {
+                message_journal_abort(que->journal);
+                errno = EAGAIN;
+            }
+        }
+    } else if ((rtn = ring_buffer_enq(que->message_ring, (void*)message))) {
+        errno = EAGAIN;
+    }
+    if (!rtn && que->wm_high && !que->throttled &&
+        ring_buffer_num_items(que->message_ring) >= que->wm_high) {
+        /* Only producers set it, all under the write lock. */
+        __atomic_store_n(&que->throttled, 1, __ATOMIC_RELEASE);
+        throttle = 1;
+    }
     pthread_mutex_unlock(MSGQ_WLOCK(que));
 
     if (!rtn) {
-        uint64_t num = 1;
-        if (MSGQ_FD(que) != -1) {
-            (void)!write(MSGQ_FD(que), &num, sizeof(num));
-        } else {
-            que->send_cb_funcptr(que, que->cb_arg);
+        message_queue_notify(que, 1);
+        if (throttle) {
+            message_queue_wm_notify(que);
         }
     }
 
     return rtn;
 }
 
+/*
+ * Visit the sub-rings flagged in the ready bitmap, starting from a
+ * different bitmap word each time. Each visit takes at most one ring's
+ * worth of messages; a sub-ring left non-empty is flagged again, and
+ * one left empty is parked.
+ * Messages go to rcv_cb if given, otherwise into msgs[] up to max.
+ */
+static int
+message_recv_fanin(message_queue_t *que, msg_handler_cb_func_t rcv_cb,
+                   void *arg, message_header_t **msgs, int max)
+{
+    msgq_fanin_t *fanin = que->fanin;
+    message_header_t *m;
+    spsc_ring_t *ring;
+    uint64_t bits, again, num, left = 0;
+    uint32_t w, idx, budget;
+    int i = 0, slot;
+
+    if (MSGQ_FD(que) != -1) {
+        (void)!read(MSGQ_FD(que), &num, sizeof(num));
+    }
+
+    for (w = 0; w < fanin->ready_words && i < max; w++) {
+        idx = (fanin->next_word + w) % fanin->ready_words;
+        if (!__atomic_load_n(&fanin->ready[idx], __ATOMIC_RELAXED)) {
+            continue;
+        }
+        bits = __atomic_exchange_n(&fanin->ready[idx], 0, __ATOMIC_SEQ_CST);
+        again = 0;
+        while (bits && i < max) {
+            slot = idx * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            ring = fanin->rings[slot];
+            budget = ring->mask + 1;
+            while (budget-- && i < max && (m = spsc_ring_deq(ring))) {
+                if (rcv_cb) {
+                    message_queue_handle(que, rcv_cb, m, arg);
+                } else {
+                    msgs[i] = m;
+                }
+                i++;
+            }
+            if (spsc_ring_num_items(ring)) {
+                again |= 1ULL << (slot & 63);
+                continue;
+            }
+            /*
+             * Park, then look again. If a message slipped in and its
+             * producer did not take the mark, flag the ring here.
+             */
+            (void)__atomic_exchange_n(&ring->parked, 1, __ATOMIC_ACQ_REL);
+            if (spsc_ring_num_items(ring) &&
+                __atomic_exchange_n(&ring->parked, 0, __ATOMIC_ACQ_REL)) {
+                again |= 1ULL << (slot & 63);
+            }
+        }
+        /* Flag again the rings left non-empty or not visited. */
+        if (bits | again) {
+            __atomic_fetch_or(&fanin->ready[idx], bits | again,
+                              __ATOMIC_SEQ_CST);
+        }
+    }
+    fanin->next_word = (fanin->next_word + 1) % fanin->ready_words;
+
+    for (w = 0; w < fanin->ready_words && !left; w++) {
+        left = __atomic_load_n(&fanin->ready[w], __ATOMIC_RELAXED);
+    }
+    if (left) {
+        message_queue_notify(que, 1);
+    }
+    return i;
+}
+
 int message_recv(message_queue_t *que, msg_handler_cb_func_t rcv_cb, void *arg)
 {
     message_header_t *m = NULL;
-    uint64_t num;
+    uint64_t num = 0;
     int i = 0;
 
-    if (que && que->message_ring) {
-        if (que->send_cb_funcptr) {
-            while ((m = ring_buffer_deq(que->message_ring))) {
-                rcv_cb(que, m, arg);
-                i++;
-            }
-        } else {
+    if (que && que->fanin) {
+        i = message_recv_fanin(que, rcv_cb, arg, NULL, INT_MAX);
+    } else if (que && que->message_ring) {
+        if (MSGQ_FD(que) != -1) {
+            /*
+             * Only reset the counter. The ring is drained whatever
+             * the count, as message_recv_batch may have taken
+             * messages already counted.
+             */
             (void)!read(MSGQ_FD(que), &num, sizeof(num));
-            while(num--) {
-                m = (message_header_t *)ring_buffer_deq(que->message_ring);
-                assert(m);
-                rcv_cb(que, m, arg);
-                i++;
+        }
+        while ((m = ring_buffer_deq(que->message_ring))) {
+            message_queue_handle(que, rcv_cb, m, arg);
+            message_queue_delivered(que);
+            i++;
+        }
+        /*
+         * The message which crossed the high mark may have been taken
+         * before the mark was set.
+         */
+        message_queue_check_resume(que);
+    }
+    if (que && que->prof) {
+        message_prof_tick(que->prof, que);
+    }
+    return i;
+}
+
+/*
+ * Return non-zero if messages are waiting in a queue.
+ */
+static int
+message_queue_pending(message_queue_t *que)
+{
+    uint32_t w;
+
+    if (que->fanin) {
+        for (w = 0; w < que->fanin->ready_words; w++) {
+            if (__atomic_load_n(&que->fanin->ready[w], __ATOMIC_SEQ_CST)) {
+                return 1;
             }
         }
+        return 0;
+    }
+    return !ring_buffer_is_empty(que->message_ring);
+}
+
+/*
+ * Sleep on the futex of a queue until it is notified or the deadline
+ * passes. Return 0 when messages may be there, -1 on timeout.
+ */
+static int
+message_queue_futex_wait(message_queue_t *que, int timeout,
+                         const struct timespec *deadline)
+{
+    struct timespec now, rel, *tsp = NULL;
+    uint32_t val;
+    long rtn;
+
+    for (;;) {
+        __atomic_fetch_add(&que->waiters, 1, __ATOMIC_SEQ_CST);
+        val = __atomic_load_n(&que->futex, __ATOMIC_SEQ_CST);
+        if (message_queue_pending(que)) {
+            __atomic_fetch_sub(&que->waiters, 1, __ATOMIC_SEQ_CST);
+            return 0;
+        }
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rel.tv_sec = deadline->tv_sec - now.tv_sec;
+            rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+            if (rel.tv_nsec < 0) {
+                rel.tv_sec--;
+                rel.tv_nsec += 1000000000L;
+            }
+            if (rel.tv_sec < 0) {
+                __atomic_fetch_sub(&que->waiters, 1, __ATOMIC_SEQ_CST);
+                return -1;
+            }
+            tsp = &rel;
+        }
+        rtn = syscall(SYS_futex, &que->futex, FUTEX_WAIT_PRIVATE, val,
+                      tsp, NULL, 0);
+        __atomic_fetch_sub(&que->waiters, 1, __ATOMIC_SEQ_CST);
+        if (rtn == 0 || errno == EAGAIN) {
+            return 0;
+        }
+        /* EINTR, or ETIMEDOUT which is checked on the next round. */
+    }
+}
+
+/*
+ * Milliseconds left until the deadline of a message_recv_wait call.
+ */
+static int
+message_queue_wait_ms(int timeout, const struct timespec *deadline)
+{
+    struct timespec now;
+    long ms;
+
+    if (timeout <= 0) {
+        return timeout;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+         (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+int message_recv_wait(message_queue_t *que, msg_handler_cb_func_t rcv_cb,
+                      void *arg, int timeout)
+{
+    struct timespec deadline;
+    struct pollfd pfd;
+    int rtn;
+
+    if (!que || !MSGQ_IN_USE(que) || !rcv_cb ||
+        (MSGQ_FD(que) == -1 && !MSGQ_FUTEX(que))) {
+        return -1;
+    }
+
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    /*
+     * A wakeup may find nothing to take, e.g. when message_recv_batch
+     * took the messages first. Wait again until the deadline then.
+     */
+    if (MSGQ_FD(que) != -1) {
+        pfd.fd = MSGQ_FD(que);
+        pfd.events = POLLIN;
+        for (;;) {
+            rtn = poll(&pfd, 1, message_queue_wait_ms(timeout, &deadline));
+            if (rtn == -1 && errno == EINTR) {
+                continue;
+            }
+            if (rtn <= 0) {
+                return rtn;
+            }
+            rtn = message_recv(que, rcv_cb, arg);
+            if (rtn || !timeout) {
+                return rtn;
+            }
+        }
+    }
+
+    for (;;) {
+        if (message_queue_pending(que) &&
+            (rtn = message_recv(que, rcv_cb, arg))) {
+            return rtn;
+        }
+        if (!timeout || message_queue_futex_wait(que, timeout, &deadline)) {
+            return 0;
+        }
+    }
+}
+
+int message_recv_batch(message_queue_t *que, message_header_t **msgs, int max)
+{
+    message_header_t *m;
+    uint64_t num = 0;
+    int i = 0;
+
+    if (!que || !msgs || max <= 0) {
+        return 0;
+    }
+    if (que->fanin) {
+        return message_recv_fanin(que, NULL, NULL, msgs, max);
+    }
+
+    if (que->message_ring) {
+        if (MSGQ_FD(que) != -1) {
+            (void)!read(MSGQ_FD(que), &num, sizeof(num));
+        }
+        while (i < max && (m = ring_buffer_deq(que->message_ring))) {
+            msgs[i++] = m;
+        }
+        message_queue_check_resume(que);
+        /* Keep the eventfd readable while messages are left. */
+        if (MSGQ_FD(que) != -1 && !ring_buffer_is_empty(que->message_ring)) {
+            message_queue_notify(que, 1);
+        }
     }
     return i;
 }
+
+void message_recv_ack(message_queue_t *que, int num)
+{
+    if (que && que->journal && num > 0) {
+        message_journal_ack(que->journal, (uint32_t)num);
+    }
+}
+
+int message_queue_journal_enable(message_queue_t *que,
+                                 const message_journal_config_t *cfg)
+{
+    message_journal_t *journal;
+
+    if (!que || !que->message_ring || que->journal) {
+        return -1;
+    }
+
+    journal = message_journal_open(MSGQ_ID(que), cfg);
+    if (!journal) {
+        return -1;
+    }
+
+    pthread_mutex_lock(MSGQ_WLOCK(que));
+    que->journal = journal;
+    pthread_mutex_unlock(MSGQ_WLOCK(que));
+
+    return 0;
+}
+
+int message_queue_journal_replay(message_queue_t *que)
+{
+    message_header_t *m;
+    int rtn = 0, i = 0;
+
+    if (!que || !que->journal) {
+        return -1;
+    }
+
+    pthread_mutex_lock(MSGQ_WLOCK(que));
+    while (!ring_buffer_is_full(que->message_ring)) {
+        rtn = message_journal_replay_next(que->journal, &m);
+        if (rtn <= 0) {
+            break;
+        }
+        (void)ring_buffer_enq(que->message_ring, (void*)m);
+        i++;
+    }
+    pthread_mutex_unlock(MSGQ_WLOCK(que));
+
+    if (i) {
+        message_queue_notify(que, i);
+    }
+
+    return (i || rtn >= 0) ? i : -1;
+}
+
+int message_queue_journal_sync(message_queue_t *que)
+{
+    if (!que || !que->journal) {
+        return -1;
+    }
+    return message_journal_sync(que->journal);
+}
+
+int message_queue_set_watermarks(message_queue_t *que, uint32_t high,
+                                 uint32_t low, msg_wm_cb_func_t cb,
+                                 void *arg)
+{
+    if (!que || !que->message_ring || que->wm_high ||
+        !high || low >= high || high > que->message_ring->mask) {
+        return -1;
+    }
+
+    que->wm_fd = -1;
+    if (!cb) {
+        que->wm_fd = eventfd(0, EFD_NONBLOCK);
+        if (que->wm_fd == -1) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&que->wm_lock, NULL);
+    que->wm_sent = 0;
+
+    pthread_mutex_lock(MSGQ_WLOCK(que));
+    que->wm_cb = cb;
+    que->wm_arg = arg;
+    que->wm_low = low;
+    que->throttled = 0;
+    que->wm_high = high;
+    pthread_mutex_unlock(MSGQ_WLOCK(que));
+
+    return 0;
+}
+
+int message_queue_get_wm_fd(message_queue_t *que)
+{
+    return (que && que->wm_high) ? que->wm_fd : -1;
+}
+
+int message_queue_is_throttled(int que_id)
+{
+    assert(que_id < max_queue_num);
+
+    return __atomic_load_n(&msg_queues[que_id].throttled, __ATOMIC_ACQUIRE);
+}
+
+int message_queue_prof_enable(message_queue_t *que,
+                              const message_prof_config_t *cfg)
+{
+    message_prof_t *prof;
+
+    if (!que || !MSGQ_IN_USE(que)) {
+        return -1;
+    }
+    prof = message_prof_new(cfg);
+    if (!prof) {
+        return -1;
+    }
+    if (que->prof) {
+        message_prof_free(que->prof);
+    }
+    que->prof = prof;
+    return 0;
+}
+
+void message_queue_prof_disable(message_queue_t *que)
+{
+    if (que && que->prof) {
+        message_prof_free(que->prof);
+        que->prof = NULL;
+    }
+}
+
+int message_queue_prof_snapshot(message_queue_t *que,
+                                message_prof_entry_t *entries, int max)
+{
+    if (!que || !que->prof || !entries || max < 0) {
+        return -1;
+    }
+    return message_prof_snapshot(que->prof, entries, max);
+}
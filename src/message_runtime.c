@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2024  sh4run
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of message_queue nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Module runtime.
+ *
+ * Worker threads each own the queues of a set of modules and loop over
+ * them, sleeping in epoll_wait or spinning. Start and drain are
+ * synchronized with barriers so that start returns only once every
+ * queue exists, and stop returns only once every worker has drained.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "message_runtime.h"
+
+/* Upper bound of drain rounds on stop. */
+#define RUNTIME_DRAIN_ROUNDS   64
+#define RUNTIME_EPOLL_EVENTS   32
+#define RUNTIME_STOP_EVENT     UINT32_MAX
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()   __builtin_ia32_pause()
+#else
+#define cpu_relax()   sched_yield()
+#endif
+
+typedef struct _msg_worker_t {
+    struct _message_runtime_t  *rt;
+    int                        index;
+    message_worker_config_t    cfg;
+    message_module_config_t    *modules;
+    message_queue_t            **queues;
+    pthread_t                  thread;
+    int                        started;
+    int                        epfd;
+    int                        stop_fd;
+} msg_worker_t;
+
+/**
+ * Structure which holds a runtime.
+ */
+struct _message_runtime_t {
+    int                worker_num;
+    int                mode;
+    int                stop;
+    int                failed;
+    uint64_t           drained;
+    uint64_t           round_total;
+    /* Start barrier. */
+    pthread_mutex_t    start_lock;
+    pthread_cond_t     start_cond;
+    int                ready;
+    int                go;
+    pthread_barrier_t  drain_barrier;
+    msg_worker_t       *workers;
+};
+
+#define RT_STOPPING(rt) __atomic_load_n(&(rt)->stop, __ATOMIC_RELAXED)
+
+static void
+runtime_noop_notif(message_queue_t *que, void *arg)
+{
+    UNUSED(que);
+    UNUSED(arg);
+}
+
+static void
+runtime_free_msg(message_queue_t *que, message_header_t *msg, void *arg)
+{
+    UNUSED(que);
+    UNUSED(arg);
+    message_free(msg);
+}
+
+static int
+worker_setup(msg_worker_t *w)
+{
+    message_runtime_t *rt = w->rt;
+    message_module_config_t *mod;
+    struct epoll_event ev;
+    cpu_set_t cpus;
+    int i;
+
+    if (w->cfg.cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cfg.cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+            return -1;
+        }
+    }
+
+    if (rt->mode == MSG_RUNTIME_EPOLL) {
+        w->epfd = epoll_create1(0);
+        w->stop_fd = eventfd(0, EFD_NONBLOCK);
+        if (w->epfd == -1 || w->stop_fd == -1) {
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.u32 = RUNTIME_STOP_EVENT;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->stop_fd, &ev)) {
+            return -1;
+        }
+    }
+
+    /*
+     * Queues are created on the worker so that their memory is
+     * first touched on the worker's CPU.
+     */
+    for (i = 0; i < w->cfg.module_num; i++) {
+        mod = &w->modules[i];
+        if (rt->mode == MSG_RUNTIME_EPOLL) {
+            w->queues[i] = message_queue_new(mod->queue_id, mod->queue_depth,
+                                             NULL, NULL);
+        } else {
+            w->queues[i] = message_queue_new(mod->queue_id, mod->queue_depth,
+                                             runtime_noop_notif, NULL);
+        }
+        if (!w->queues[i]) {
+            return -1;
+        }
+        if (rt->mode == MSG_RUNTIME_EPOLL) {
+            ev.events = EPOLLIN;
+            ev.data.u32 = i;
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD,
+                          message_queue_get_fd(w->queues[i]), &ev)) {
+                return -1;
+            }
+        }
+    }
+
+    if (w->cfg.init_cb) {
+        w->cfg.init_cb(w->index, w->cfg.cb_arg);
+    }
+    return 0;
+}
+
+static uint64_t
+worker_poll(msg_worker_t *w)
+{
+    message_module_config_t *mod;
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < w->cfg.module_num; i++) {
+        mod = &w->modules[i];
+        n += message_recv(w->queues[i], mod->handler, mod->arg);
+    }
+    return n;
+}
+
+static void
+worker_loop(msg_worker_t *w)
+{
+    struct epoll_event evs[RUNTIME_EPOLL_EVENTS];
+    message_module_config_t *mod;
+    int n, i;
+
+    if (w->rt->mode == MSG_RUNTIME_BUSY_POLL) {
+        while (!RT_STOPPING(w->rt)) {
+            if (!worker_poll(w)) {
+                cpu_relax();
+            }
+        }
+        return;
+    }
+
+    while (!RT_STOPPING(w->rt)) {
+        n = epoll_wait(w->epfd, evs, RUNTIME_EPOLL_EVENTS, -1);
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.u32 == RUNTIME_STOP_EVENT) {
+                continue;
+            }
+            mod = &w->modules[evs[i].data.u32];
+            message_recv(w->queues[evs[i].data.u32], mod->handler, mod->arg);
+        }
+    }
+}
+
+/*
+ * Drain in rounds. Every worker empties its queues, then all compare
+ * how much was handled; a round where nobody handled anything means
+ * no message is left in flight between workers.
+ */
+static void
+worker_drain(msg_worker_t *w)
+{
+    message_runtime_t *rt = w->rt;
+    uint64_t n, total;
+    int round;
+
+    for (round = 0; round < RUNTIME_DRAIN_ROUNDS; round++) {
+        total = 0;
+        while ((n = worker_poll(w))) {
+            total += n;
+        }
+        __atomic_add_fetch(&rt->drained, total, __ATOMIC_RELAXED);
+
+        if (pthread_barrier_wait(&rt->drain_barrier) ==
+                                    PTHREAD_BARRIER_SERIAL_THREAD) {
+            rt->round_total = __atomic_exchange_n(&rt->drained, 0,
+                                                  __ATOMIC_RELAXED);
+        }
+        pthread_barrier_wait(&rt->drain_barrier);
+        if (!rt->round_total) {
+            break;
+        }
+    }
+}
+
+static void *
+worker_thread(void *arg)
+{
+    msg_worker_t *w = (msg_worker_t *)arg;
+    message_runtime_t *rt = w->rt;
+
+    int failed = worker_setup(w);
+
+    /* Start barrier: everybody is ready or somebody failed. */
+    pthread_mutex_lock(&rt->start_lock);
+    if (failed) {
+        rt->failed = 1;
+    }
+    rt->ready++;
+    pthread_cond_broadcast(&rt->start_cond);
+    while (!rt->go) {
+        pthread_cond_wait(&rt->start_cond, &rt->start_lock);
+    }
+    failed = rt->failed;
+    pthread_mutex_unlock(&rt->start_lock);
+    if (failed) {
+        return NULL;
+    }
+
+    worker_loop(w);
+    worker_drain(w);
+
+    if (w->cfg.fini_cb) {
+        w->cfg.fini_cb(w->index, w->cfg.cb_arg);
+    }
+    return NULL;
+}
+
+static void
+runtime_release(message_runtime_t *rt)
+{
+    msg_worker_t *w;
+    int i, j;
+
+    for (i = 0; i < rt->worker_num; i++) {
+        w = &rt->workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+        }
+        for (j = 0; w->queues && j < w->cfg.module_num; j++) {
+            if (w->queues[j]) {
+                message_recv(w->queues[j], runtime_free_msg, NULL);
+                message_queue_free(w->queues[j]);
+            }
+        }
+        if (w->epfd != -1) {
+            close(w->epfd);
+        }
+        if (w->stop_fd != -1) {
+            close(w->stop_fd);
+        }
+        free(w->queues);
+        free(w->modules);
+    }
+    pthread_cond_destroy(&rt->start_cond);
+    pthread_mutex_destroy(&rt->start_lock);
+    pthread_barrier_destroy(&rt->drain_barrier);
+    free(rt->workers);
+    free(rt);
+}
+
+message_runtime_t *
+message_runtime_start(const message_runtime_config_t *cfg)
+{
+    message_runtime_t *rt;
+    msg_worker_t *w;
+    int i, started = 0;
+
+    if (!cfg || !cfg->workers || cfg->worker_num <= 0) {
+        return NULL;
+    }
+    for (i = 0; i < cfg->worker_num; i++) {
+        if (cfg->workers[i].cpu >= CPU_SETSIZE) {
+            return NULL;
+        }
+    }
+
+    rt = (message_runtime_t *)calloc(1, sizeof(message_runtime_t));
+    if (!rt) {
+        return NULL;
+    }
+    rt->worker_num = cfg->worker_num;
+    rt->mode = cfg->mode;
+    rt->workers = (msg_worker_t *)calloc(cfg->worker_num,
+                                         sizeof(msg_worker_t));
+    if (!rt->workers) {
+        free(rt);
+        return NULL;
+    }
+    for (i = 0; i < cfg->worker_num; i++) {
+        rt->workers[i].epfd = rt->workers[i].stop_fd = -1;
+    }
+    (void)!pthread_mutex_init(&rt->start_lock, NULL);
+    (void)!pthread_cond_init(&rt->start_cond, NULL);
+    (void)!pthread_barrier_init(&rt->drain_barrier, NULL, cfg->worker_num);
+
+    for (i = 0; i < cfg->worker_num; i++) {
+        w = &rt->workers[i];
+        w->rt = rt;
+        w->index = i;
+        w->cfg = cfg->workers[i];
+        w->modules = (message_module_config_t *)
+            calloc(w->cfg.module_num + 1, sizeof(message_module_config_t));
+        w->queues = (message_queue_t **)
+            calloc(w->cfg.module_num + 1, sizeof(message_queue_t *));
+        if (!w->modules || !w->queues) {
+            goto start_err;
+        }
+        memcpy(w->modules, w->cfg.modules,
+               w->cfg.module_num * sizeof(message_module_config_t));
+    }
+
+    for (i = 0; i < cfg->worker_num; i++) {
+        w = &rt->workers[i];
+        if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+            break;
+        }
+        w->started = 1;
+        started++;
+    }
+
+    pthread_mutex_lock(&rt->start_lock);
+    if (started < cfg->worker_num) {
+        rt->failed = 1;
+    }
+    while (rt->ready < started) {
+        pthread_cond_wait(&rt->start_cond, &rt->start_lock);
+    }
+    rt->go = 1;
+    pthread_cond_broadcast(&rt->start_cond);
+    pthread_mutex_unlock(&rt->start_lock);
+
+    if (rt->failed) {
+        runtime_release(rt);
+        return NULL;
+    }
+    return rt;
+
+start_err:
+    runtime_release(rt);
+    return NULL;
+}
+
+int message_runtime_stop(message_runtime_t *rt)
+{
+    uint64_t one = 1;
+    int i;
+
+    __atomic_store_n(&rt->stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < rt->worker_num; i++) {
+        if (rt->workers[i].stop_fd != -1) {
+            (void)!write(rt->workers[i].stop_fd, &one, sizeof(one));
+        }
+    }
+    runtime_release(rt);
+    return 0;
+}